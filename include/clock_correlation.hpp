@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+#include <sycl/sycl.hpp>
+
+// how often the offset between the device and the host clocks is measured again
+#ifndef SYNERGY_CLOCK_CORRELATION_PERIOD_MS
+#define SYNERGY_CLOCK_CORRELATION_PERIOD_MS 1000
+#endif
+
+namespace synergy {
+
+namespace detail {
+
+class clock_marker_kernel;
+
+/**
+ * Maps the profiling timestamps of a device, which are in the device clock domain, onto the host
+ * steady_clock. Every measurement brackets a few marker kernels between two host readings, which
+ * bound the offset between the clocks from both sides; the offset and the drift are fitted over the
+ * latest measurements, weighting each one by how tight its bounds are. Measurements after the first
+ * run on a thread of their own, so that callers never wait for the markers to get through the
+ * backlog of a busy device.
+ */
+class clock_correlation {
+public:
+  using clock = std::chrono::steady_clock;
+
+  clock_correlation(const sycl::device& sycl_device)
+      : markers{sycl_device, sycl::property_list{sycl::property::queue::enable_profiling{}}} {
+    for (std::size_t attempt = 0; measurements.empty() && attempt < measurements_kept; attempt++) {
+      auto m = measure();
+      if (m)
+        add(*m);
+    }
+    if (measurements.empty())
+      throw std::runtime_error("synergy::clock_correlation error: the device timestamps are inconsistent with the host clock");
+
+    measured = clock::now();
+    measurer = std::thread{[this] { run(); }};
+  }
+
+  clock_correlation(const clock_correlation&) = delete;
+  clock_correlation& operator=(const clock_correlation&) = delete;
+
+  ~clock_correlation() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      finished = true;
+    }
+    wake.notify_one();
+    measurer.join();
+  }
+
+  // asks for a new measurement when the latest one is older than the correlation period, without waiting for it
+  void refresh() {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (!requested && clock::now() - measured >= std::chrono::milliseconds{SYNERGY_CLOCK_CORRELATION_PERIOD_MS}) {
+      requested = true;
+      wake.notify_one();
+    }
+  }
+
+  clock::time_point to_host(std::uint64_t device_timestamp) const {
+    std::lock_guard<std::mutex> lock{mutex};
+    double from_reference = static_cast<double>(static_cast<std::int64_t>(device_timestamp - reference));
+    auto ns = static_cast<std::int64_t>(device_timestamp) + static_cast<std::int64_t>(offset + drift * from_reference);
+    return clock::time_point{std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds{ns})};
+  }
+
+  // nanoseconds of host time elapsed per nanosecond of device time, minus one
+  double get_drift() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return drift;
+  }
+
+  // bound on the error of to_host: the farthest a bound of a kept measurement lies from the fit
+  clock::duration get_error() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds{static_cast<std::int64_t>(std::ceil(error))});
+  }
+
+private:
+  struct measurement {
+    std::uint64_t device_time; // nanoseconds
+    double offset;             // nanoseconds to add to device_time to get the host time
+    double width;              // nanoseconds between the bounds of the offset
+  };
+
+  static constexpr int markers_per_measurement = 3;
+  static constexpr std::size_t measurements_kept = 8;
+
+  sycl::queue markers; // only used by the constructor and then by the measurer thread
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  bool requested = false;
+  bool finished = false;
+  std::deque<measurement> measurements;
+  clock::time_point measured;
+  std::uint64_t reference = 0;
+  double offset = 0.0;
+  double drift = 0.0;
+  double error = 0.0;
+  std::thread measurer; // declared last: started once the other members are initialized
+
+  static std::int64_t host_nanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (true) {
+      wake.wait(lock, [this] { return requested || finished; });
+      if (finished)
+        return;
+
+      lock.unlock();
+      std::optional<measurement> m;
+      try {
+        m = measure();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+      }
+      lock.lock();
+
+      if (m)
+        add(*m);
+      measured = clock::now();
+      requested = false;
+    }
+  }
+
+  // called without the mutex held; markers whose bounds contradict each other are dropped
+  std::optional<measurement> measure() {
+    std::int64_t lower = std::numeric_limits<std::int64_t>::min();
+    std::int64_t upper = std::numeric_limits<std::int64_t>::max();
+    std::uint64_t device_time = 0;
+
+    for (int i = 0; i < markers_per_measurement; i++) {
+      std::int64_t before = host_nanoseconds();
+      sycl::event marker = markers.single_task<clock_marker_kernel>([]() {});
+      marker.wait();
+      std::int64_t after = host_nanoseconds();
+
+      auto start = marker.get_profiling_info<sycl::info::event_profiling::command_start>();
+      auto end = marker.get_profiling_info<sycl::info::event_profiling::command_end>();
+      lower = std::max(lower, before - static_cast<std::int64_t>(start));
+      upper = std::min(upper, after - static_cast<std::int64_t>(end));
+      device_time = start + (end - start) / 2;
+    }
+
+    if (lower > upper)
+      return std::nullopt;
+
+    return measurement{device_time, lower + (upper - lower) / 2.0, static_cast<double>(upper - lower)};
+  }
+
+  // must be called with the mutex held
+  void add(const measurement& m) {
+    measurements.push_back(m);
+    if (measurements.size() > measurements_kept)
+      measurements.pop_front();
+
+    fit();
+  }
+
+  // weighted least squares of the offset against the device time, relative to the latest measurement
+  void fit() {
+    reference = measurements.back().device_time;
+
+    double sw = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+    for (const auto& m : measurements) {
+      double w = 1.0 / ((m.width + 1.0) * (m.width + 1.0));
+      double x = static_cast<double>(static_cast<std::int64_t>(m.device_time - reference));
+      sw += w;
+      sx += w * x;
+      sy += w * m.offset;
+      sxx += w * x * x;
+      sxy += w * x * m.offset;
+    }
+
+    double denominator = sw * sxx - sx * sx;
+    if (measurements.size() < 2 || denominator <= 0.0) {
+      drift = 0.0;
+      offset = sy / sw;
+    } else {
+      drift = (sw * sxy - sx * sy) / denominator;
+      offset = (sy - drift * sx) / sw;
+    }
+
+    error = 0.0;
+    for (const auto& m : measurements) {
+      double x = static_cast<double>(static_cast<std::int64_t>(m.device_time - reference));
+      error = std::max(error, std::abs(m.offset - (offset + drift * x)) + m.width / 2);
+    }
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
@@ -1,16 +1,28 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
 
 #include "device_impl.hpp"
+#ifdef SYNERGY_ENABLE_PROFILING
+#include "power_trace.hpp"
+#endif
 #include "types.hpp"
 
 namespace synergy {
 
+namespace detail {
+class telemetry_sampler;
+} // namespace detail
+
 class device {
 public:
   device() = default;
+#ifdef SYNERGY_ENABLE_PROFILING
+  device(std::shared_ptr<detail::device_impl> impl) : impl{impl}, trace{std::make_shared<detail::power_trace>()} {}
+#else
   device(std::shared_ptr<detail::device_impl> impl) : impl{impl} {}
+#endif
 
   inline std::vector<frequency> supported_core_frequencies() { return impl->supported_core_frequencies(); }
 
@@ -26,14 +38,41 @@ public:
 
   inline void set_all_frequencies(frequency core, frequency uncore) { impl->set_all_frequencies(core, uncore); }
 
+  // returns the clocks to the default management of the driver
+  inline void reset_frequencies() { impl->reset_frequencies(); }
+
   inline power get_power_usage() { return impl->get_power_usage(); }
 
-  inline energy get_energy_usage() { return impl->get_energy_usage(); }
+  inline energy get_energy_usage() const { return impl->get_energy_usage(); }
+
+  // power, energy, clocks, temperature, utilization and throttle reasons at once
+  inline device_sample sample() const { return impl->sample(); }
 
   inline unsigned get_power_sampling_rate() { return impl->get_power_sampling_rate(); }
 
+  // whether get_energy_usage is supported, otherwise the energy is integrated from get_power_usage
+  inline bool has_energy_counter() const { return impl->has_energy_counter(); }
+
+#ifdef SYNERGY_ENABLE_PROFILING
+  // joules consumed in a past window, from the records of the device sampler while a synergy::queue is profiling the device
+  inline double energy_between(std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1) const { return trace->energy_between(t0, t1); }
+
+  // joules recorded in the power trace since it started, 0 before the first record
+  inline double get_recorded_energy() const {
+    auto last = trace->latest();
+    return last ? last->energy : 0.0;
+  }
+
+  inline std::vector<power_record> power_records_between(std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1) const { return trace->records_between(t0, t1); }
+#endif
+
 private:
+  friend class detail::telemetry_sampler;
+
   std::shared_ptr<detail::device_impl> impl;
+#ifdef SYNERGY_ENABLE_PROFILING
+  std::shared_ptr<detail::power_trace> trace;
+#endif
 };
 
 } // namespace synergy
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <vector>
+
 #include "management_wrapper.hpp"
 #include "types.hpp"
 
@@ -26,51 +33,156 @@ public:
 
   virtual void set_all_frequencies(frequency core, frequency uncore) = 0;
 
+  virtual void reset_frequencies() = 0;
+
   virtual power get_power_usage() = 0;
 
   virtual energy get_energy_usage() = 0;
 
+  virtual device_sample sample() = 0;
+
   virtual unsigned get_power_sampling_rate() = 0;
+
+  virtual bool has_energy_counter() = 0;
+};
+
+/**
+ * Vendor libraries are initialized by the first device that uses them and shut down when the last
+ * one is destroyed, instead of once per device.
+ */
+template <typename vendor>
+class library_reference {
+public:
+  library_reference(const management_wrapper<vendor>& library) : library{library} {
+    std::lock_guard<std::mutex> lock{state().mutex};
+    if (state().count == 0)
+      library.initialize();
+    state().count++;
+  }
+
+  library_reference(const library_reference&) = delete;
+  library_reference& operator=(const library_reference&) = delete;
+
+  ~library_reference() {
+    std::lock_guard<std::mutex> lock{state().mutex};
+    if (--state().count == 0) {
+      try {
+        library.shutdown();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+      }
+    }
+  }
+
+private:
+  struct shared_state {
+    std::mutex mutex;
+    unsigned count = 0;
+  };
+
+  const management_wrapper<vendor>& library;
+
+  static shared_state& state() {
+    static shared_state s;
+    return s;
+  }
 };
 
 template <typename vendor>
 class vendor_device : public device_impl {
 
 public:
-  inline vendor_device(typename vendor::device_identifier id) {
-    library.initialize();
-    handle = library.get_device_handle(id);
+  // the PCI address, when SYCL reports it, identifies the device regardless of how each library orders its devices
+  inline vendor_device(typename vendor::device_identifier id, std::optional<pci_address> address = std::nullopt) {
+    handle = address ? library.get_device_handle(*address) : library.get_device_handle(id);
 
     current_core_frequency = library.get_core_frequency(handle);
     current_uncore_frequency = library.get_uncore_frequency(handle);
-  }
 
-  inline ~vendor_device() { library.shutdown(); }
+    core_frequencies = sorted(library.get_supported_core_frequencies(handle));
+    uncore_frequencies = sorted(library.get_supported_uncore_frequencies(handle));
+    if constexpr (vendor::paired_clocks) {
+      for (frequency uncore : uncore_frequencies)
+        cores_per_uncore.emplace(uncore, sorted(library.get_supported_core_frequencies(handle, uncore)));
+    }
+
+    // some devices of a vendor, e.g. NVIDIA GPUs older than Volta, lack the counter
+    try {
+      library.get_energy_usage(handle);
+      energy_counter = true;
+    } catch (const std::exception&) {
+      energy_counter = false;
+    }
+  }
 
-  inline std::vector<frequency> supported_core_frequencies() { return library.get_supported_core_frequencies(handle); }
+  // at the current uncore frequency
+  inline std::vector<frequency> supported_core_frequencies() { return core_table(current_uncore_frequency); }
 
-  inline std::vector<frequency> supported_uncore_frequencies() { return library.get_supported_uncore_frequencies(handle); }
+  inline std::vector<frequency> supported_uncore_frequencies() { return uncore_frequencies; }
 
   inline frequency get_core_frequency(bool cached = true) { return cached ? current_core_frequency : library.get_core_frequency(handle); }
 
   inline frequency get_uncore_frequency(bool cached = true) { return cached ? current_uncore_frequency : library.get_uncore_frequency(handle); }
 
+  // targets are snapped to the nearest supported frequency, and nothing is done when it is the one last set
   inline void set_core_frequency(frequency target) {
-    library.set_core_frequency(handle, target);
-    current_core_frequency = target;
-    current_uncore_frequency = library.get_uncore_frequency(handle);
+    frequency core = nearest(core_table(current_uncore_frequency), target);
+    if (core_pinned && core == current_core_frequency)
+      return;
+
+    if constexpr (vendor::paired_clocks) {
+      library.set_all_frequencies(handle, core, current_uncore_frequency);
+      uncore_pinned = true;
+    } else {
+      library.set_core_frequency(handle, core);
+    }
+    current_core_frequency = core;
+    core_pinned = true;
   }
 
+  // with paired clocks the core frequency moves to the highest one supported with the new uncore frequency
   inline void set_uncore_frequency(frequency target) {
-    library.set_uncore_frequency(handle, target);
-    current_uncore_frequency = target;
-    current_core_frequency = library.get_core_frequency(handle);
+    frequency uncore = nearest(uncore_frequencies, target);
+    if (uncore_pinned && uncore == current_uncore_frequency)
+      return;
+
+    if constexpr (vendor::paired_clocks) {
+      const auto& cores = core_table(uncore);
+      frequency core = cores.empty() ? current_core_frequency : cores.back();
+      library.set_all_frequencies(handle, core, uncore);
+      current_core_frequency = core;
+      core_pinned = true;
+    } else {
+      library.set_uncore_frequency(handle, uncore);
+    }
+    current_uncore_frequency = uncore;
+    uncore_pinned = true;
   }
 
-  inline void set_all_frequencies(frequency core, frequency uncore) {
-    library.set_all_frequencies(handle, core, uncore);
+  inline void set_all_frequencies(frequency core_target, frequency uncore_target) {
+    frequency uncore = nearest(uncore_frequencies, uncore_target);
+    frequency core = nearest(core_table(uncore), core_target);
+
+    if constexpr (vendor::paired_clocks) {
+      if (!core_pinned || !uncore_pinned || core != current_core_frequency || uncore != current_uncore_frequency)
+        library.set_all_frequencies(handle, core, uncore);
+    } else {
+      if (!uncore_pinned || uncore != current_uncore_frequency)
+        library.set_uncore_frequency(handle, uncore);
+      if (!core_pinned || core != current_core_frequency)
+        library.set_core_frequency(handle, core);
+    }
     current_core_frequency = core;
     current_uncore_frequency = uncore;
+    core_pinned = uncore_pinned = true;
+  }
+
+  // hands the clocks back to the driver, like before the first frequency was set
+  inline void reset_frequencies() {
+    library.reset_frequencies(handle);
+    current_core_frequency = library.get_core_frequency(handle);
+    current_uncore_frequency = library.get_uncore_frequency(handle);
+    core_pinned = uncore_pinned = false;
   }
 
   inline power get_power_usage() {
@@ -81,15 +193,61 @@ public:
     return library.get_energy_usage(handle);
   }
 
+  inline device_sample sample() {
+    return library.sample(handle);
+  }
+
   inline unsigned get_power_sampling_rate() {
     return vendor::sampling_rate;
   }
 
+  inline bool has_energy_counter() { return energy_counter; }
+
 private:
   management_wrapper<vendor> library;
+  library_reference<vendor> reference{library};
   typename vendor::device_handle handle;
   frequency current_core_frequency;
   frequency current_uncore_frequency;
+  // until a frequency is set the cached one is the live clock, e.g. the idle one, and a target equal to it must still be set
+  bool core_pinned = false;
+  bool uncore_pinned = false;
+  bool energy_counter;
+
+  // read once, sorted in ascending order; with paired clocks the valid core frequencies depend on the uncore one
+  std::vector<frequency> core_frequencies;
+  std::vector<frequency> uncore_frequencies;
+  std::map<frequency, std::vector<frequency>> cores_per_uncore;
+
+  const std::vector<frequency>& core_table(frequency uncore) const {
+    if constexpr (vendor::paired_clocks) {
+      auto search = cores_per_uncore.find(uncore);
+      if (search != cores_per_uncore.end())
+        return search->second;
+    }
+    return core_frequencies;
+  }
+
+  static std::vector<frequency> sorted(std::vector<frequency> frequencies) {
+    std::sort(frequencies.begin(), frequencies.end());
+    frequencies.erase(std::unique(frequencies.begin(), frequencies.end()), frequencies.end());
+    return frequencies;
+  }
+
+  // the closest supported frequency, the lower one on ties; targets pass unchanged when the table is unknown
+  static frequency nearest(const std::vector<frequency>& table, frequency target) {
+    if (table.empty())
+      return target;
+
+    auto above = std::lower_bound(table.begin(), table.end(), target);
+    if (above == table.begin())
+      return *above;
+    if (above == table.end())
+      return table.back();
+
+    auto below = std::prev(above);
+    return target - *below <= *above - target ? *below : *above;
+  }
 };
 
 } // namespace detail
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <dlfcn.h>
+
+#include <initializer_list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace synergy {
+
+namespace detail {
+
+/**
+ * A vendor library opened with dlopen the first time one of its devices is used, with
+ * SYNERGY_DYNAMIC_VENDORS. Its entry points are function pointers with the names of the functions
+ * they replace, declared in namespace synergy::detail so that the wrappers call them unchanged and
+ * through a single indirect call, as through the PLT of a linked library. The library is never
+ * closed: some vendor libraries do not support being unloaded.
+ */
+class dynamic_library {
+public:
+  dynamic_library(std::string_view vendor, std::initializer_list<const char*> candidates)
+      : vendor{vendor}, candidates{candidates} {}
+
+  dynamic_library(const dynamic_library&) = delete;
+  dynamic_library& operator=(const dynamic_library&) = delete;
+
+  // opens the library and resolves its functions once; a failed attempt is retried on the next call
+  template <typename Resolver>
+  void load(Resolver resolve_all) {
+    std::call_once(loaded, [this, &resolve_all] {
+      std::string errors;
+      for (const char* name : candidates) {
+        handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+        if (handle)
+          break;
+        errors += std::string{"\n  "} + dlerror();
+      }
+
+      if (!handle)
+        throw std::runtime_error{"synergy " + std::string(vendor) + " wrapper error: could not load the vendor library:" + errors};
+
+      resolve_all(*this);
+    });
+  }
+
+  template <typename Function>
+  void resolve(Function& pointer, const char* symbol) const {
+    pointer = reinterpret_cast<Function>(dlsym(handle, symbol));
+    if (!pointer)
+      throw std::runtime_error{"synergy " + std::string(vendor) + " wrapper error: the vendor library lacks " + symbol};
+  }
+
+private:
+  std::string_view vendor;
+  std::vector<const char*> candidates;
+  std::once_flag loaded;
+  void* handle = nullptr;
+};
+
+} // namespace detail
+
+} // namespace synergy
+
+// declares the pointer replacing a vendor function, to be expanded in namespace synergy::detail
+#define SYNERGY_DECLARE_VENDOR_FUNCTION(function) inline decltype(&::function) function = nullptr;
+
+// resolves the pointer of a vendor function, to be expanded where a dynamic_library named library is in scope
+#define SYNERGY_RESOLVE_VENDOR_FUNCTION(function) library.resolve(function, #function);
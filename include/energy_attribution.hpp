@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sycl/sycl.hpp>
+
+#include "clock_correlation.hpp"
+#include "device.hpp"
+#include "power_trace.hpp"
+#include "telemetry_sampler.hpp"
+
+namespace synergy {
+
+enum class attribution_rule {
+  proportional_time, // at every instant the power is split evenly among the running kernels
+  occupancy,         // like proportional_time, weighted by the occupancy hint of each kernel
+  equal_share        // the energy of a sampling interval is split evenly among the kernels running in it
+};
+
+namespace detail {
+
+/**
+ * Splits the energy of one device among the kernels that run on it, whichever queue they were
+ * submitted to. The power trace of the device is recorded on the host clock by its telemetry
+ * sampler, kernel execution windows come from the command_start/command_end profiling timestamps
+ * mapped onto the same clock by the clock correlation of the device, and the energy of every part
+ * of the trace is shared among the kernels overlapping it according to the attribution rule.
+ */
+class attribution_engine {
+public:
+  using clock = std::chrono::steady_clock;
+
+  attribution_engine(synergy::device device, const sycl::device& sycl_device, std::shared_ptr<telemetry_sampler> telemetry)
+      : device{device}, telemetry{telemetry}, correlation{sycl_device} {}
+
+  attribution_engine(const attribution_engine&) = delete;
+  attribution_engine& operator=(const attribution_engine&) = delete;
+
+  using reservation_id = std::uint64_t;
+
+  // must be called before a kernel is submitted: the attributions it may overlap wait until its
+  // event is tracked or the reservation is cancelled, instead of missing a kernel already running
+  reservation_id reserve() {
+    std::lock_guard<std::mutex> lock{mutex};
+    reservation_id id = ++next_reservation;
+    reserved.emplace(id, clock::now()); // the kernel cannot start before
+    return id;
+  }
+
+  void track(reservation_id id, const sycl::event& event, double occupancy = 1.0) {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      auto search = reserved.find(id);
+      if (search == reserved.end())
+        throw std::runtime_error("synergy::attribution_engine error: kernel was not reserved");
+
+      kernels.insert_or_assign(event, tracked_kernel{search->second, occupancy});
+      reserved.erase(search);
+    }
+    reservations_changed.notify_all();
+  }
+
+  // the submission failed
+  void cancel(reservation_id id) {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      reserved.erase(id);
+    }
+    reservations_changed.notify_all();
+  }
+
+  // waits until the kernel and the kernels that may overlap it are complete, and the power trace covers its execution
+  double attribute(sycl::event event) {
+    event.wait();
+    correlation.refresh();
+    interval own = interval_of(event);
+
+    auto sampling_rate = std::chrono::milliseconds{device.get_power_sampling_rate()};
+    while (telemetry->covered_until() < own.end)
+      std::this_thread::sleep_for(sampling_rate);
+
+    auto trace = telemetry->records_between(own.start, own.end);
+    if (trace.empty() || trace.front().time > own.start)
+      throw std::runtime_error("synergy::attribution_engine error: the kernel started before the power trace");
+
+    // kernels submitted after this one ended cannot overlap it, the others are waited for, and so
+    // are the kernels still being submitted
+    std::vector<sycl::event> pending;
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      if (kernels.find(event) == kernels.end())
+        throw std::runtime_error("synergy::attribution_engine error: kernel was not tracked");
+
+      auto correlation_error = correlation.get_error();
+      reservations_changed.wait(lock, [&] {
+        return std::none_of(reserved.begin(), reserved.end(), [&](const auto& r) { return r.second < own.end + correlation_error; });
+      });
+
+      for (const auto& [e, other] : kernels)
+        if (!(e == event) && !other.has_span && other.submitted < own.end + correlation_error)
+          pending.push_back(e);
+    }
+
+    std::vector<std::pair<sycl::event, interval>> completed;
+    for (auto& e : pending) {
+      e.wait();
+      completed.emplace_back(e, interval_of(e));
+    }
+
+    std::lock_guard<std::mutex> lock{mutex};
+    for (const auto& [e, span] : completed) {
+      auto search = kernels.find(e);
+      if (search != kernels.end()) {
+        search->second.span = span;
+        search->second.has_span = true;
+      }
+    }
+
+    tracked_kernel& k = kernels.at(event);
+    k.span = own;
+    k.has_span = true;
+
+    std::vector<weighted_interval> others;
+    for (const auto& [e, other] : kernels)
+      if (!(e == event) && other.has_span && other.span.start < own.end && other.span.end > own.start)
+        others.push_back(weighted_interval{other.span, other.occupancy});
+
+    double energy = integrate(trace, weighted_interval{own, k.occupancy}, others);
+    k.attributed = true;
+    prune();
+
+    return energy;
+  }
+
+  void set_rule(attribution_rule new_rule) {
+    std::lock_guard<std::mutex> lock{mutex};
+    rule = new_rule;
+  }
+
+private:
+  struct interval {
+    clock::time_point start;
+    clock::time_point end;
+  };
+
+  struct weighted_interval {
+    interval span;
+    double weight;
+  };
+
+  struct tracked_kernel {
+    clock::time_point submitted;
+    double occupancy = 1.0;
+    bool has_span = false;
+    interval span{};
+    bool attributed = false;
+  };
+
+  synergy::device device;
+  std::shared_ptr<telemetry_sampler> telemetry;
+  clock_correlation correlation;
+  attribution_rule rule = attribution_rule::proportional_time;
+
+  std::mutex mutex;
+  std::unordered_map<sycl::event, tracked_kernel> kernels;
+  std::unordered_map<reservation_id, clock::time_point> reserved; // kernels being submitted, with the time before the submission
+  reservation_id next_reservation = 0;
+  std::condition_variable reservations_changed;
+
+  static double seconds(clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  }
+
+  interval interval_of(const sycl::event& event) const {
+    return interval{
+        correlation.to_host(event.get_profiling_info<sycl::info::event_profiling::command_start>()),
+        correlation.to_host(event.get_profiling_info<sycl::info::event_profiling::command_end>())};
+  }
+
+  static double busy_time(std::vector<interval> spans) {
+    std::sort(spans.begin(), spans.end(), [](const interval& a, const interval& b) { return a.start < b.start; });
+
+    double busy = 0.0;
+    clock::time_point covered = clock::time_point::min();
+    for (const auto& s : spans) {
+      auto from = std::max(s.start, covered);
+      if (s.end > from) {
+        busy += seconds(s.end - from);
+        covered = s.end;
+      }
+    }
+    return busy;
+  }
+
+  // must be called with the mutex held
+  double integrate(const std::vector<power_record>& trace, const weighted_interval& own, const std::vector<weighted_interval>& others) const {
+    double energy = 0.0;
+
+    for (size_t i = 1; i < trace.size(); i++) {
+      auto a = trace[i - 1].time;
+      auto b = trace[i].time;
+      if (b <= own.span.start)
+        continue;
+      if (a >= own.span.end)
+        break;
+
+      double power = (trace[i].energy - trace[i - 1].energy) / seconds(b - a);
+
+      if (rule == attribution_rule::equal_share) {
+        std::vector<interval> spans{interval{std::max(a, own.span.start), std::min(b, own.span.end)}};
+        for (const auto& o : others)
+          if (o.span.start < b && o.span.end > a)
+            spans.push_back(interval{std::max(a, o.span.start), std::min(b, o.span.end)});
+
+        energy += power * busy_time(spans) / spans.size();
+        continue;
+      }
+
+      // split the part of the sample covered by the kernel wherever another kernel starts or ends
+      auto from = std::max(a, own.span.start);
+      auto to = std::min(b, own.span.end);
+      std::vector<clock::time_point> cuts{from, to};
+      for (const auto& o : others) {
+        if (o.span.start > from && o.span.start < to)
+          cuts.push_back(o.span.start);
+        if (o.span.end > from && o.span.end < to)
+          cuts.push_back(o.span.end);
+      }
+      std::sort(cuts.begin(), cuts.end());
+
+      double own_weight = rule == attribution_rule::occupancy ? own.weight : 1.0;
+      for (size_t c = 1; c < cuts.size(); c++) {
+        if (cuts[c] == cuts[c - 1])
+          continue;
+
+        double total_weight = own_weight;
+        for (const auto& o : others)
+          if (o.span.start <= cuts[c - 1] && o.span.end >= cuts[c])
+            total_weight += rule == attribution_rule::occupancy ? o.weight : 1.0;
+
+        energy += power * seconds(cuts[c] - cuts[c - 1]) * own_weight / total_weight;
+      }
+    }
+
+    return energy;
+  }
+
+  // must be called with the mutex held; drops the kernels no pending kernel can overlap
+  void prune() {
+    auto correlation_error = correlation.get_error();
+    auto oldest_needed = clock::time_point::max();
+    for (const auto& [e, k] : kernels)
+      if (!k.attributed)
+        oldest_needed = std::min(oldest_needed, k.submitted - correlation_error);
+    for (const auto& [id, submitted] : reserved)
+      oldest_needed = std::min(oldest_needed, submitted - correlation_error);
+
+    for (auto it = kernels.begin(); it != kernels.end();) {
+      if (it->second.attributed && it->second.span.end < oldest_needed)
+        it = kernels.erase(it);
+      else
+        ++it;
+    }
+  }
+};
+
+/**
+ * A kernel about to be submitted, reserved with the attribution engine of its device before the
+ * submission and tracked once its event is known; the reservation is cancelled if the kernel is
+ * never tracked, e.g. when the submission throws.
+ */
+class kernel_reservation {
+public:
+  kernel_reservation(std::shared_ptr<attribution_engine> engine) : engine{std::move(engine)}, id{this->engine->reserve()} {}
+
+  kernel_reservation(const kernel_reservation&) = delete;
+  kernel_reservation& operator=(const kernel_reservation&) = delete;
+
+  ~kernel_reservation() {
+    if (engine)
+      engine->cancel(id);
+  }
+
+  void track(const sycl::event& event, double occupancy) {
+    engine->track(id, event, occupancy);
+    engine.reset();
+  }
+
+private:
+  std::shared_ptr<attribution_engine> engine;
+  attribution_engine::reservation_id id;
+};
+
+} // namespace detail
+
+} // namespace synergy
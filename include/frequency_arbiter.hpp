@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "device.hpp"
+#include "types.hpp"
+
+namespace synergy {
+
+enum class arbitration_policy {
+  latest_wins,     // the most recent request is applied
+  max_of_requests, // the highest requested frequency is applied
+  priority         // the request of the highest priority queue is applied, the most recent one on ties
+};
+
+namespace detail {
+
+/**
+ * Shared by all the queues of one physical device. Every queue holds a standing request per
+ * frequency domain (0 means no request) until it releases it or is destroyed, and the arbiter
+ * applies the target chosen by the policy, calling the vendor library only when that target differs
+ * from the current device frequency.
+ * Frequency scopes take precedence over the queue requests: the most recent scope wins, and when
+ * the outermost scope exits the domains the scopes set go back to the driver defaults, unless a
+ * queue requests them.
+ */
+class frequency_arbiter {
+public:
+  using requester_id = std::size_t;
+  using scope_id = std::uint64_t;
+
+  frequency_arbiter(synergy::device device, arbitration_policy policy = arbitration_policy::latest_wins)
+      : device{device}, policy{policy} {}
+
+  requester_id register_requester(int priority = 0) {
+    std::lock_guard<std::mutex> lock{mutex};
+    requester_id id = next_id++;
+    requests.emplace(id, request{priority});
+    return id;
+  }
+
+  void unregister_requester(requester_id id) {
+    std::lock_guard<std::mutex> lock{mutex};
+    requests.erase(id);
+    apply();
+  }
+
+  void request_frequencies(requester_id id, frequency uncore_frequency, frequency core_frequency) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto& r = requests.at(id);
+    if (core_frequency) {
+      r.core = core_frequency;
+      r.core_stamp = ++stamp;
+    }
+    if (uncore_frequency) {
+      r.uncore = uncore_frequency;
+      r.uncore_stamp = ++stamp;
+    }
+    apply();
+  }
+
+  // withdraws the request, e.g. so that a high frequency does not hold the clock up under max_of_requests
+  void release_frequencies(requester_id id) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto& r = requests.at(id);
+    r.core = 0;
+    r.uncore = 0;
+    apply();
+  }
+
+  void set_priority(requester_id id, int priority) {
+    std::lock_guard<std::mutex> lock{mutex};
+    requests.at(id).priority = priority;
+    apply();
+  }
+
+  void set_policy(arbitration_policy new_policy) {
+    std::lock_guard<std::mutex> lock{mutex};
+    policy = new_policy;
+    apply();
+  }
+
+  arbitration_policy get_policy() {
+    std::lock_guard<std::mutex> lock{mutex};
+    return policy;
+  }
+
+  scope_id push_scope(frequency uncore_frequency, frequency core_frequency) {
+    std::lock_guard<std::mutex> lock{mutex};
+    scope_id id = ++next_scope;
+    scopes.push_back(scope{id, core_frequency, uncore_frequency});
+    scoped_core |= core_frequency != 0;
+    scoped_uncore |= uncore_frequency != 0;
+    apply();
+    return id;
+  }
+
+  // scopes may exit in any order when they belong to different threads
+  void pop_scope(scope_id id) {
+    std::lock_guard<std::mutex> lock{mutex};
+    scopes.erase(std::remove_if(scopes.begin(), scopes.end(), [id](const scope& s) { return s.id == id; }), scopes.end());
+
+    // the clocks the scopes pinned are released rather than set back to a sampled value, which may
+    // have been the idle or boost clock of the moment
+    if (scopes.empty()) {
+      bool core_free = scoped_core && effective_target<&request::core, &request::core_stamp>() == 0;
+      bool uncore_free = scoped_uncore && effective_target<&request::uncore, &request::uncore_stamp>() == 0;
+      scoped_core = scoped_uncore = false;
+      if (core_free || uncore_free)
+        device.reset_frequencies();
+    }
+    apply();
+  }
+
+private:
+  struct request {
+    int priority = 0;
+    frequency core = 0;
+    frequency uncore = 0;
+    std::uint64_t core_stamp = 0;
+    std::uint64_t uncore_stamp = 0;
+  };
+
+  struct scope {
+    scope_id id;
+    frequency core;
+    frequency uncore;
+  };
+
+  synergy::device device;
+  arbitration_policy policy;
+  std::mutex mutex;
+  std::unordered_map<requester_id, request> requests;
+  requester_id next_id = 0;
+  std::uint64_t stamp = 0;
+
+  std::vector<scope> scopes; // innermost last
+  scope_id next_scope = 0;
+  bool scoped_core = false; // whether a scope set the domain since the outermost one was entered
+  bool scoped_uncore = false;
+
+  // returns 0 when no queue is requesting a frequency for the domain
+  template <frequency request::*target, std::uint64_t request::*target_stamp>
+  frequency effective_target() const {
+    const request* chosen = nullptr;
+
+    for (const auto& [id, r] : requests) {
+      if (r.*target == 0)
+        continue;
+
+      if (chosen == nullptr) {
+        chosen = &r;
+        continue;
+      }
+
+      switch (policy) {
+      case arbitration_policy::latest_wins:
+        if (r.*target_stamp > chosen->*target_stamp)
+          chosen = &r;
+        break;
+      case arbitration_policy::max_of_requests:
+        if (r.*target > chosen->*target)
+          chosen = &r;
+        break;
+      case arbitration_policy::priority:
+        if (r.priority > chosen->priority || (r.priority == chosen->priority && r.*target_stamp > chosen->*target_stamp))
+          chosen = &r;
+        break;
+      }
+    }
+
+    return chosen ? chosen->*target : 0;
+  }
+
+  template <frequency scope::*target>
+  frequency scoped_target() const {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+      if ((*it).*target != 0)
+        return (*it).*target;
+    return 0;
+  }
+
+  // must be called with the mutex held; domains nobody targets are left as they are
+  void apply() {
+    frequency core = scoped_target<&scope::core>();
+    if (core == 0)
+      core = effective_target<&request::core, &request::core_stamp>();
+
+    frequency uncore = scoped_target<&scope::uncore>();
+    if (uncore == 0)
+      uncore = effective_target<&request::uncore, &request::uncore_stamp>();
+
+    // the device skips the frequencies it has already set; a single call avoids vendors that reset
+    // the core clock when the uncore one changes
+    if (core != 0 && uncore != 0)
+      device.set_all_frequencies(core, uncore);
+    else if (core != 0)
+      device.set_core_frequency(core);
+    else if (uncore != 0)
+      device.set_uncore_frequency(uncore);
+  }
+};
+
+/**
+ * Registration of a queue with the frequency arbiter of its device; copies of a queue share it and
+ * the standing request is dropped when the last copy is destroyed.
+ */
+class frequency_requester {
+public:
+  frequency_requester(std::shared_ptr<frequency_arbiter> arbiter, int priority = 0)
+      : arbiter{arbiter}, id{arbiter->register_requester(priority)} {}
+
+  frequency_requester(const frequency_requester&) = delete;
+  frequency_requester& operator=(const frequency_requester&) = delete;
+
+  ~frequency_requester() {
+    try {
+      arbiter->unregister_requester(id);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+    }
+  }
+
+  inline void request_frequencies(frequency uncore_frequency, frequency core_frequency) {
+    arbiter->request_frequencies(id, uncore_frequency, core_frequency);
+  }
+
+  inline void release_frequencies() { arbiter->release_frequencies(id); }
+
+  inline void set_priority(int priority) { arbiter->set_priority(id, priority); }
+
+  inline void set_policy(arbitration_policy policy) { arbiter->set_policy(policy); }
+
+  inline arbitration_policy get_policy() { return arbiter->get_policy(); }
+
+private:
+  std::shared_ptr<frequency_arbiter> arbiter;
+  frequency_arbiter::requester_id id;
+};
+
+} // namespace detail
+
+} // namespace synergy
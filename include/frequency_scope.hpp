@@ -0,0 +1,42 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+
+#include "frequency_arbiter.hpp"
+#include "queue.hpp"
+#include "runtime.hpp"
+#include "types.hpp"
+
+namespace synergy {
+
+/**
+ * Applies a pair of frequencies to the device of a queue until the scope exits, then restores the
+ * setting of the enclosing scope; the outermost one hands the clocks back to the driver, unless a
+ * queue requests them. Scopes nest, may be opened from any thread, and take precedence
+ * over the frequency targets of the queues on the same device. Transitions that do not change the
+ * effective frequencies do not call the vendor library. 0 leaves a domain to the enclosing setting.
+ */
+class frequency_scope {
+public:
+  frequency_scope(const synergy::queue& q, frequency uncore_frequency, frequency core_frequency)
+      : arbiter{detail::runtime::frequency_arbiter_from(q.get_device())},
+        id{arbiter->push_scope(uncore_frequency, core_frequency)} {}
+
+  frequency_scope(const frequency_scope&) = delete;
+  frequency_scope& operator=(const frequency_scope&) = delete;
+
+  ~frequency_scope() {
+    try {
+      arbiter->pop_scope(id);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+    }
+  }
+
+private:
+  std::shared_ptr<detail::frequency_arbiter> arbiter;
+  detail::frequency_arbiter::scope_id id;
+};
+
+} // namespace synergy
@@ -1,3 +1,5 @@
+#pragma once
+
 /**
  * @file host_profiler.hpp
  * @brief Host profiler implementation
@@ -6,23 +8,45 @@
  * required. The host profiler is only available on Linux.
 */
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <istream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <filesystem>
+#include <fcntl.h>
 #include <unistd.h>
 
+// mount points of sysfs and procfs read by the host profiler and the CPU support, e.g. a fake tree for testing
+#ifndef SYNERGY_SYSFS_ROOT
+#define SYNERGY_SYSFS_ROOT "/sys"
+#endif
+
+#ifndef SYNERGY_PROCFS_ROOT
+#define SYNERGY_PROCFS_ROOT "/proc"
+#endif
+
 namespace synergy {
 namespace host_profiler {
 namespace detail {
 
-  constexpr auto POWERCAP_ROOT_DIR = "/sys/class/powercap";
+  constexpr auto POWERCAP_ROOT_DIR = SYNERGY_SYSFS_ROOT "/class/powercap";
   constexpr auto POWERCAP_ENERGY_FILE = "energy_uj";
   constexpr auto POWERCAP_UNCORE_NAME = "dram";
   constexpr auto POWERCAP_CORE_NAME = "core";
   constexpr auto POWERCAP_PACKAGE_NAME = "package";
 
-  void check_root_privileges() {
+  inline void check_root_privileges() {
     if (geteuid() != 0) {
       throw std::runtime_error("synergy::host_profiler error: root privileges required");
     }
@@ -33,14 +57,15 @@ namespace detail {
    * @param base_path The base path of the Powercap interface
    * @return A vector containing the names
   */
-  std::vector<std::string> get_packages(std::string base_path = POWERCAP_ROOT_DIR) {
+  inline std::vector<std::string> get_packages(std::string base_path = POWERCAP_ROOT_DIR) {
     std::vector<std::string> packages;
     std::filesystem::path path(base_path);
 
     for (const auto& entry : std::filesystem::directory_iterator(path)) {
       if (entry.is_directory()) {
         std::string name = entry.path().filename().string();
-        if (name.find(":") == name.length() - 2) {
+        // e.g. intel-rapl:0; the mmio zones duplicate the packages on some Intel systems
+        if (name.find(':') != std::string::npos && name.find(':') == name.rfind(':') && name.find("mmio") == std::string::npos) {
           packages.push_back(name);
         }
       }
@@ -49,6 +74,28 @@ namespace detail {
     return packages;
   }
 
+  // owns a file descriptor, closed when the owner is destroyed
+  class file_descriptor {
+  public:
+    explicit file_descriptor(int fd) : fd{fd} {}
+
+    file_descriptor(file_descriptor&& other) noexcept : fd{other.fd} { other.fd = -1; }
+    file_descriptor& operator=(file_descriptor&& other) noexcept {
+      std::swap(fd, other.fd);
+      return *this;
+    }
+
+    ~file_descriptor() {
+      if (fd >= 0)
+        close(fd);
+    }
+
+    int get() const { return fd; }
+
+  private:
+    int fd;
+  };
+
   template <typename... Args>
   std::string build_path(Args... args) {
     std::string path;
@@ -58,32 +105,373 @@ namespace detail {
 } // namespace detail
   using namespace detail;
 
+  enum class rapl_domain {
+    package,
+    core,
+    uncore,
+    dram,
+    psys // whole platform, not included in the packages
+  };
+
   /**
-   * @brief Get the energy consumption of the host in microjoules
-   * @details Get the energy consumption of the host in microjoules. The function uses the Powercap
-   * interface to get the energy consumption of the host.
-   * @return A monotonically increasing value representing the energy consumption of the host in
-   * microjoules
-   * @throws std::runtime_error if the energy file(s) cannot be opened
-  */
-  double get_host_energy() {
-    double energy = 0;
-    unsigned long long e;
+   * @brief Reader of the RAPL energy counters exposed by the Powercap interface
+   * @details The zones are discovered once, when the reader is created, and their energy files are
+   * kept open and read with pread. Counter wraparounds are detected using the max_energy_range_uj
+   * of each zone, so the energy returned by the reader is monotonically increasing.
+   */
+  class rapl_reader {
+  public:
+    /**
+     * @param root The base path of the Powercap interface, e.g. a fake sysfs tree for testing
+     * @throws std::runtime_error if no zone is found or an energy file cannot be opened
+    */
+    explicit rapl_reader(const std::string& root = POWERCAP_ROOT_DIR) {
+      for (const auto& p : get_packages(root)) {
+        std::filesystem::path package_path = std::filesystem::path{root} / p;
+        unsigned package = static_cast<unsigned>(std::stoul(p.substr(p.rfind(':') + 1)));
+        add_zone(package_path, package);
 
-    check_root_privileges();
+        for (const auto& entry : std::filesystem::directory_iterator(package_path)) {
+          std::string name = entry.path().filename().string();
+          if (entry.is_directory() && name.rfind(p + ":", 0) == 0)
+            add_zone(entry.path(), package);
+        }
+      }
+
+      if (zones.empty())
+        throw std::runtime_error("synergy::host_profiler error: no RAPL zone found in " + root);
+    }
 
-    // if it's a multi-cpu architecture, we want to sum the energy of all the cpus
-    for (const auto& p : get_packages()) {
-      std::string path = build_path(POWERCAP_ROOT_DIR, p, POWERCAP_ENERGY_FILE);
-      std::ifstream file {path, std::ios::in};
-      if (!file.is_open()) {
+    rapl_reader(const rapl_reader&) = delete;
+    rapl_reader& operator=(const rapl_reader&) = delete;
+
+    /**
+     * @brief Get the energy consumed by the zones of a domain in microjoules
+     * @param domain The domain to read
+     * @param package The index of the package to read, all of them by default
+     * @return The energy consumed since the reader was created
+    */
+    double energy(rapl_domain domain, int package = -1) {
+      std::lock_guard<std::mutex> lock{mutex};
+      double total = 0.0;
+      for (auto& z : zones) {
+        if (z.domain == domain && (package < 0 || z.package == static_cast<unsigned>(package))) {
+          update(z);
+          total += z.accumulated;
+        }
+      }
+      return total;
+    }
+
+    bool has_domain(rapl_domain domain) const {
+      for (const auto& z : zones)
+        if (z.domain == domain)
+          return true;
+      return false;
+    }
+
+    // indices of the packages, in the order they were discovered
+    std::vector<unsigned> get_package_indices() const {
+      std::vector<unsigned> packages;
+      for (const auto& z : zones)
+        if (z.domain == rapl_domain::package)
+          packages.push_back(z.package);
+      return packages;
+    }
+
+  private:
+    struct zone {
+      rapl_domain domain;
+      unsigned package;
+      file_descriptor fd;
+      unsigned long long max_range; // the counter wraps around after this value
+      unsigned long long last;
+      double accumulated = 0.0;
+    };
+
+    std::vector<zone> zones;
+    std::mutex mutex;
+
+    static std::string read_line(const std::filesystem::path& path) {
+      std::ifstream file{path, std::ios::in};
+      std::string line;
+      std::getline(file, line);
+      return line;
+    }
+
+    static unsigned long long read_counter(int fd) {
+      char buffer[32];
+      ssize_t bytes = pread(fd, buffer, sizeof(buffer) - 1, 0);
+      if (bytes <= 0) {
+        throw std::runtime_error("synergy::host_profiler error: could not read energy register file");
+      }
+      buffer[bytes] = '\0';
+      return std::strtoull(buffer, nullptr, 10);
+    }
+
+    void add_zone(const std::filesystem::path& path, unsigned package) {
+      std::string name = read_line(path / "name");
+      rapl_domain domain;
+      if (name.rfind(POWERCAP_PACKAGE_NAME, 0) == 0)
+        domain = rapl_domain::package;
+      else if (name == POWERCAP_CORE_NAME)
+        domain = rapl_domain::core;
+      else if (name == "uncore")
+        domain = rapl_domain::uncore;
+      else if (name == POWERCAP_UNCORE_NAME)
+        domain = rapl_domain::dram;
+      else if (name == "psys")
+        domain = rapl_domain::psys;
+      else
+        return;
+
+      file_descriptor fd{open((path / POWERCAP_ENERGY_FILE).c_str(), O_RDONLY)};
+      if (fd.get() < 0) {
         throw std::runtime_error("synergy::host_profiler error: could not open energy register file");
       }
-      file >> e;
-      energy += static_cast<double>(e);
+
+      std::string max_range = read_line(path / "max_energy_range_uj");
+      unsigned long long last = read_counter(fd.get());
+      zones.push_back(zone{domain, package, std::move(fd), max_range.empty() ? 0 : std::stoull(max_range), last});
+    }
+
+    // must be called with the mutex held
+    static void update(zone& z) {
+      unsigned long long current = read_counter(z.fd.get());
+      if (current >= z.last)
+        z.accumulated += static_cast<double>(current - z.last);
+      else if (z.max_range > z.last)
+        z.accumulated += static_cast<double>(z.max_range - z.last + current); // wraparound
+      z.last = current;
+    }
+  };
+
+  /**
+   * @brief Splits the package energy of the host by the share of CPU time of this process
+   * @details The energy each package consumes is accumulated at every update and, once per
+   * attribution window, multiplied by the fraction of the busy time of its CPUs spent running the
+   * threads of this process, so the jobs co-scheduled on the same sockets are not charged to it.
+   * CPU times only advance by whole clock ticks, so the window spans several of them, and the energy
+   * of a window in which a socket recorded no busy tick is carried to the next one. The CPU time of
+   * every thread is assigned to the socket of the CPU it last ran on. The RAPL package index is
+   * assumed to match the physical_package_id of the CPUs.
+   */
+  class process_energy_attributor {
+  public:
+    /**
+     * @param proc_root The mount point of procfs, e.g. a synthetic tree for testing
+     * @param sys_root The mount point of sysfs, which contains the CPU topology and Powercap
+    */
+    explicit process_energy_attributor(const std::string& proc_root = SYNERGY_PROCFS_ROOT, const std::string& sys_root = SYNERGY_SYSFS_ROOT)
+        : proc_root{proc_root}, rapl{sys_root + "/class/powercap"} {
+      read_topology(sys_root);
+      for (unsigned package : rapl.get_package_indices())
+        last_package_energy[package] = rapl.energy(rapl_domain::package, static_cast<int>(package));
+      last_cpu_busy = read_cpu_busy();
+      last_threads = read_threads();
+      last_process_ticks = read_process().ticks;
+
+      long ticks_per_second = sysconf(_SC_CLK_TCK);
+      window = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>{static_cast<double>(window_ticks) / (ticks_per_second > 0 ? ticks_per_second : 100)});
+      window_start = clock::now();
+    }
+
+    /**
+     * @brief Update the energy with the interval elapsed since the previous update
+     * @details Only reads the RAPL counters, except once per attribution window, when the CPU times
+     * are read from procfs to split the energy accumulated in the meantime.
+     * @return The package energy of the host and the part of it attributed to this process, in
+     * microjoules since the attributor was created; the latter lags by up to one window
+    */
+    std::pair<double, double> update() {
+      std::lock_guard<std::mutex> lock{mutex};
+
+      for (auto& [package, last] : last_package_energy) {
+        double current = rapl.energy(rapl_domain::package, static_cast<int>(package));
+        package_energy += current - last;
+        unattributed_energy[package] += current - last;
+        last = current;
+      }
+
+      auto now = clock::now();
+      if (now - window_start >= window) {
+        attribute();
+        window_start = now;
+      }
+
+      return {package_energy, process_energy};
     }
 
-    return energy;
+  private:
+    struct task_time {
+      unsigned long long ticks; // user and system time in clock ticks
+      unsigned cpu;             // CPU the task last ran on
+    };
+
+    using clock = std::chrono::steady_clock;
+
+    static constexpr unsigned window_ticks = 10; // clock ticks per attribution window, bounding the rounding of the CPU times
+
+    std::string proc_root;
+    rapl_reader rapl;
+    std::mutex mutex;
+    clock::duration window;
+    clock::time_point window_start;
+    std::unordered_map<unsigned, unsigned> cpu_socket;
+    std::unordered_map<unsigned, unsigned long long> last_cpu_busy;
+    std::unordered_map<unsigned, task_time> last_threads;
+    std::unordered_map<unsigned, double> last_package_energy;
+    std::unordered_map<unsigned, double> unattributed_energy; // consumed by each package since its last share
+    unsigned long long last_process_ticks = 0;
+    double package_energy = 0.0;
+    double process_energy = 0.0;
+
+    // must be called with the mutex held; splits the energy accumulated during the window
+    void attribute() {
+      auto cpu_busy = read_cpu_busy();
+      auto threads = read_threads();
+      auto process = read_process();
+
+      std::unordered_map<unsigned, double> socket_busy;
+      for (const auto& [cpu, busy] : cpu_busy) {
+        auto previous = last_cpu_busy.find(cpu);
+        if (previous != last_cpu_busy.end() && busy >= previous->second)
+          socket_busy[socket_of(cpu)] += static_cast<double>(busy - previous->second);
+      }
+
+      std::unordered_map<unsigned, double> socket_process;
+      double thread_ticks = 0.0;
+      for (const auto& [tid, t] : threads) {
+        auto previous = last_threads.find(tid);
+        unsigned long long before = previous != last_threads.end() ? previous->second.ticks : 0; // started during the interval
+        if (t.ticks > before) {
+          socket_process[socket_of(t.cpu)] += static_cast<double>(t.ticks - before);
+          thread_ticks += static_cast<double>(t.ticks - before);
+        }
+      }
+
+      // threads that exited during the interval only appear in the total of the process
+      double process_ticks = process.ticks > last_process_ticks ? static_cast<double>(process.ticks - last_process_ticks) : 0.0;
+      if (process_ticks > thread_ticks) {
+        double remainder = process_ticks - thread_ticks;
+        if (thread_ticks > 0.0) {
+          for (auto& [socket, ticks] : socket_process)
+            ticks += remainder * ticks / thread_ticks;
+        } else {
+          socket_process[socket_of(process.cpu)] += remainder;
+        }
+      }
+
+      for (auto& [package, consumed] : unattributed_energy) {
+        double busy = socket_busy[package];
+        if (busy > 0.0) {
+          process_energy += consumed * std::min(1.0, socket_process[package] / busy);
+          consumed = 0.0;
+        }
+      }
+
+      last_cpu_busy = std::move(cpu_busy);
+      last_threads = std::move(threads);
+      last_process_ticks = process.ticks;
+    }
+
+    unsigned socket_of(unsigned cpu) const {
+      auto search = cpu_socket.find(cpu);
+      return search != cpu_socket.end() ? search->second : 0;
+    }
+
+    void read_topology(const std::string& sys_root) {
+      std::filesystem::path cpus{sys_root + "/devices/system/cpu"};
+      for (const auto& entry : std::filesystem::directory_iterator(cpus)) {
+        std::string name = entry.path().filename().string();
+        if (name.size() < 4 || name.compare(0, 3, "cpu") != 0 || name.find_first_not_of("0123456789", 3) != std::string::npos)
+          continue;
+
+        std::ifstream file{entry.path() / "topology" / "physical_package_id"};
+        unsigned socket = 0;
+        if (file >> socket)
+          cpu_socket[static_cast<unsigned>(std::stoul(name.substr(3)))] = socket;
+      }
+    }
+
+    // busy clock ticks of every CPU from the cpuN lines of /proc/stat
+    std::unordered_map<unsigned, unsigned long long> read_cpu_busy() const {
+      std::unordered_map<unsigned, unsigned long long> busy;
+      std::ifstream file{proc_root + "/stat"};
+      std::string line;
+      while (std::getline(file, line)) {
+        if (line.size() < 4 || line.compare(0, 3, "cpu") != 0 || !std::isdigit(static_cast<unsigned char>(line[3])))
+          continue;
+
+        std::istringstream fields{line.substr(3)};
+        unsigned cpu;
+        unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+        fields >> cpu >> user >> nice >> system >> idle >> iowait >> irq >> softirq >> steal;
+        busy[cpu] = user + nice + system + irq + softirq + steal;
+      }
+      return busy;
+    }
+
+    // utime, stime and processor of a /proc/<pid>/stat file; the fields are counted after the command name
+    static std::optional<task_time> read_stat(const std::filesystem::path& path) {
+      std::ifstream file{path};
+      std::string line;
+      if (!std::getline(file, line))
+        return std::nullopt;
+
+      auto end_of_name = line.rfind(')');
+      if (end_of_name == std::string::npos)
+        return std::nullopt;
+
+      std::istringstream fields{line.substr(end_of_name + 1)};
+      std::vector<std::string> values{std::istream_iterator<std::string>{fields}, std::istream_iterator<std::string>{}};
+      if (values.size() < 37)
+        return std::nullopt;
+
+      return task_time{std::stoull(values[11]) + std::stoull(values[12]), static_cast<unsigned>(std::stoul(values[36]))};
+    }
+
+    task_time read_process() const {
+      auto process = read_stat(std::filesystem::path{proc_root} / "self" / "stat");
+      return process ? *process : task_time{last_process_ticks, 0};
+    }
+
+    std::unordered_map<unsigned, task_time> read_threads() const {
+      std::unordered_map<unsigned, task_time> threads;
+      std::error_code error;
+      for (const auto& entry : std::filesystem::directory_iterator(std::filesystem::path{proc_root} / "self" / "task", error)) {
+        auto t = read_stat(entry.path() / "stat"); // the thread may have exited in the meantime
+        if (t)
+          threads[static_cast<unsigned>(std::stoul(entry.path().filename().string()))] = *t;
+      }
+      return threads;
+    }
+  };
+
+  /**
+   * @brief Get the energy consumption of the host in microjoules
+   * @details Get the energy consumption of the packages of the host in microjoules. The function
+   * uses a reader of the Powercap interface created on the first call.
+   * @return A monotonically increasing value representing the energy consumption of the host in
+   * microjoules
+   * @throws std::runtime_error if the energy file(s) cannot be opened
+  */
+  inline double get_host_energy() {
+    static rapl_reader reader;
+    return reader.energy(rapl_domain::package);
+  }
+
+  /**
+   * @brief Get the energy consumption of the host and the part attributed to this process
+   * @details The package energy of the host is split by the share of CPU time of this process on
+   * every socket, using an attributor created on the first call.
+   * @return The package energy of the host and the energy attributed to this process, in
+   * microjoules, both monotonically increasing
+   * @throws std::runtime_error if the energy file(s) cannot be opened
+  */
+  inline std::pair<double, double> get_process_host_energy() {
+    static process_energy_attributor attributor;
+    return attributor.update();
   }
 
 } // namespace host_profiler
@@ -1,19 +1,32 @@
 #pragma once
 
+#include <cstdint>
+#include <future>
+
 #include <sycl/sycl.hpp>
 
 namespace synergy {
 
+enum class command_kind {
+  compute, // kernels
+  transfer // memcpy, memset, fill and copy
+};
+
 namespace detail {
 struct kernel {
-  kernel(sycl::event event) : event{event} {}
+  kernel(sycl::event event, std::shared_future<double> energy, command_kind kind = command_kind::compute)
+      : event{event}, energy{energy}, kind{kind} {}
 
   sycl::event event;
-  double energy = 0.0;
+  std::shared_future<double> energy; // ready once the kernel has been profiled
+  command_kind kind;
 };
 
 inline bool operator==(const kernel& lhs, const kernel& rhs) { return lhs.event == rhs.event; }
 
+// kernels submitted by the calling thread through any synergy::queue, counted by the regions
+inline thread_local std::uint64_t submitted_kernels = 0;
+
 } // namespace detail
 
 } // namespace synergy
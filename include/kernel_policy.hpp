@@ -0,0 +1,83 @@
+#pragma once
+
+#include <type_traits>
+
+#include "types.hpp"
+
+namespace synergy {
+
+// frequencies of a synergy::kernel_policy, named so that the two clocks cannot be swapped by mistake
+template <frequency Frequency>
+struct core_clock {
+  static constexpr frequency core = Frequency;
+  static constexpr frequency uncore = 0;
+};
+
+template <frequency Frequency>
+struct uncore_clock {
+  static constexpr frequency core = 0;
+  static constexpr frequency uncore = Frequency;
+};
+
+namespace detail {
+
+template <typename T>
+struct is_core_clock : std::false_type {};
+
+template <frequency Frequency>
+struct is_core_clock<core_clock<Frequency>> : std::true_type {};
+
+template <typename T>
+struct is_uncore_clock : std::false_type {};
+
+template <frequency Frequency>
+struct is_uncore_clock<uncore_clock<Frequency>> : std::true_type {};
+
+} // namespace detail
+
+/**
+ * Binds the frequencies a kernel runs at to its name at compile time, e.g.
+ * q.parallel_for<synergy::kernel_policy<class mat_mul, synergy::core_clock<1215>, synergy::uncore_clock<877>>>(...)
+ * or, for command groups, q.submit<synergy::kernel_policy<class mat_mul, synergy::core_clock<1215>>>(cgf)
+ * with h.parallel_for<class mat_mul>. The clocks may be given in any order; a missing one is left unchanged.
+ */
+template <typename KernelName, typename... Clocks>
+struct kernel_policy {
+  static_assert(((detail::is_core_clock<Clocks>::value || detail::is_uncore_clock<Clocks>::value) && ...),
+                "synergy::kernel_policy error: frequencies must be given as synergy::core_clock or synergy::uncore_clock");
+  static_assert((0 + ... + detail::is_core_clock<Clocks>::value) <= 1 && (0 + ... + detail::is_uncore_clock<Clocks>::value) <= 1,
+                "synergy::kernel_policy error: each clock can be given once");
+
+  using name = KernelName;
+  static constexpr frequency uncore_frequency = (frequency{0} + ... + Clocks::uncore);
+  static constexpr frequency core_frequency = (frequency{0} + ... + Clocks::core);
+};
+
+namespace detail {
+
+template <typename T>
+struct is_kernel_policy : std::false_type {};
+
+template <typename KernelName, typename... Clocks>
+struct is_kernel_policy<kernel_policy<KernelName, Clocks...>> : std::true_type {};
+
+template <typename T>
+inline constexpr bool is_kernel_policy_v = is_kernel_policy<T>::value;
+
+// the name handed to the SYCL implementation
+template <typename T>
+struct kernel_name_of {
+  using type = T;
+};
+
+template <typename KernelName, typename... Clocks>
+struct kernel_name_of<kernel_policy<KernelName, Clocks...>> {
+  using type = KernelName;
+};
+
+template <typename T>
+using kernel_name_of_t = typename kernel_name_of<T>::type;
+
+} // namespace detail
+
+} // namespace synergy
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <sycl/sycl.hpp>
+
+#include "kernel.hpp"
+
+// default number of kernel records a queue keeps before evicting the oldest ones
+#ifndef SYNERGY_KERNEL_REGISTRY_CAPACITY
+#define SYNERGY_KERNEL_REGISTRY_CAPACITY 65536
+#endif
+
+namespace synergy {
+
+struct kernel_retention {
+  std::size_t capacity = SYNERGY_KERNEL_REGISTRY_CAPACITY; // 0 keeps every record until it is released
+  std::chrono::milliseconds max_age{0};                    // 0 disables time-based eviction
+};
+
+struct kernel_record {
+  sycl::event event;
+  double energy;
+  command_kind kind;
+};
+
+namespace detail {
+
+/**
+ * Kernel records indexed by their event. Records leave the registry when they are released or
+ * drained, when the capacity is exceeded (oldest first) or when they get older than max_age.
+ * Expired records are evicted by every operation, so lookups never return them.
+ */
+class kernel_registry {
+public:
+  void insert(const kernel& k) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto now = clock::now();
+
+    auto search = records.find(k.event);
+    if (search != records.end()) {
+      order.erase(search->second.position);
+      records.erase(search);
+    }
+
+    auto position = order.insert(order.end(), k.event);
+    records.emplace(k.event, entry{k, now, position});
+    evict(now);
+  }
+
+  kernel find(const sycl::event& event) const {
+    std::lock_guard<std::mutex> lock{mutex};
+    evict(clock::now());
+    auto search = records.find(event);
+    if (search == records.end())
+      throw std::runtime_error("synergy::queue error: kernel was not submitted to the queue or its record was released");
+
+    return search->second.k;
+  }
+
+  bool release(const sycl::event& event) {
+    std::lock_guard<std::mutex> lock{mutex};
+    evict(clock::now());
+    auto search = records.find(event);
+    if (search == records.end())
+      return false;
+
+    order.erase(search->second.position);
+    records.erase(search);
+    return true;
+  }
+
+  // removes and returns, oldest first, the records whose energy is already available
+  std::vector<kernel_record> drain() {
+    std::lock_guard<std::mutex> lock{mutex};
+    evict(clock::now());
+    std::vector<kernel_record> drained;
+
+    for (auto it = order.begin(); it != order.end();) {
+      auto search = records.find(*it);
+      auto& energy = search->second.k.energy;
+
+      if (energy.wait_for(std::chrono::seconds::zero()) == std::future_status::ready) {
+        drained.push_back(kernel_record{*it, energy.get(), search->second.k.kind});
+        records.erase(search);
+        it = order.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    return drained;
+  }
+
+  void set_retention(kernel_retention new_retention) {
+    std::lock_guard<std::mutex> lock{mutex};
+    retention = new_retention;
+    evict(clock::now());
+  }
+
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    evict(clock::now());
+    return records.size();
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct entry {
+    kernel k;
+    clock::time_point inserted;
+    std::list<sycl::event>::iterator position;
+  };
+
+  // mutable so that lookups can evict the expired records, which are no longer part of the registry
+  mutable std::unordered_map<sycl::event, entry> records;
+  mutable std::list<sycl::event> order; // insertion order, oldest first
+  kernel_retention retention;
+  mutable std::mutex mutex;
+
+  // must be called with the mutex held
+  void evict(clock::time_point now) const {
+    while (!order.empty()) {
+      auto search = records.find(order.front());
+      bool over_capacity = retention.capacity != 0 && records.size() > retention.capacity;
+      bool expired = retention.max_age.count() != 0 && now - search->second.inserted > retention.max_age;
+
+      if (!over_capacity && !expired)
+        break;
+
+      records.erase(search);
+      order.pop_front();
+    }
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
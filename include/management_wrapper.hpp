@@ -2,6 +2,7 @@
 
 #include <vector>
 
+#include "topology.hpp"
 #include "types.hpp"
 
 namespace synergy {
@@ -21,13 +22,17 @@ public:
 
   unsigned int get_devices_count() const;
   device_handle get_device_handle(device_indentifier) const;
+  device_handle get_device_handle(const pci_address&) const;
 
   power get_power_usage(device_handle) const;
   energy get_energy_usage(device_handle) const;
+  device_sample sample(device_handle) const;
 
   // sorted in ascending order
   std::vector<frequency> get_supported_core_frequencies(device_handle);
   std::vector<frequency> get_supported_uncore_frequencies(device_handle);
+  // only with vendor::paired_clocks, the core frequencies valid with the given uncore one
+  std::vector<frequency> get_supported_core_frequencies(device_handle, frequency uncore);
 
   // TODO: use templates to define only one get_frequency, and discriminate using template parameters
   frequency get_core_frequency(device_handle) const;
@@ -36,6 +41,8 @@ public:
   void set_core_frequency(device_handle, frequency) const;
   void set_uncore_frequency(device_handle, frequency) const;
   void set_all_frequencies(device_handle, frequency core, frequency uncore) const;
+  // undoes the frequencies set, returning the clocks to the driver defaults
+  void reset_frequencies(device_handle) const;
 
   void setup_profiling(device_handle) const;
   void setup_scaling(device_handle) const;
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+namespace synergy {
+
+namespace detail {
+
+/**
+ * Wakes a sampling loop on absolute deadlines, so the time spent reading the sensors does not make
+ * the period drift. When a reading takes longer than the period the deadlines it overran are
+ * skipped, instead of being caught up in a burst, and counted as missed.
+ */
+class periodic_timer {
+public:
+  using clock = std::chrono::steady_clock;
+
+  periodic_timer(std::chrono::nanoseconds period) : period{period}, deadline{clock::now() + period} {}
+
+  void wait() {
+    auto now = clock::now();
+    if (now >= deadline) {
+      auto overrun = (now - deadline) / period + 1;
+      missed.fetch_add(static_cast<std::uint64_t>(overrun), std::memory_order_relaxed);
+      deadline += period * overrun;
+    }
+
+    sleep_until(deadline);
+    deadline += period;
+  }
+
+  std::uint64_t missed_deadlines() const {
+    return missed.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::chrono::nanoseconds period;
+  clock::time_point deadline;
+  std::atomic<std::uint64_t> missed = 0;
+
+  // steady_clock is CLOCK_MONOTONIC on Linux
+  static void sleep_until(clock::time_point t) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+      ;
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "types.hpp"
+
+// records kept at full resolution for each device, at the 5 ms sampling rate of the vendor
+// libraries the default covers the last 10 minutes
+#ifndef SYNERGY_POWER_TRACE_CAPACITY
+#define SYNERGY_POWER_TRACE_CAPACITY 131072
+#endif
+
+// every this many records one is also kept in a coarser ring, which covers the windows older than
+// the full resolution one, 87 minutes more with the defaults
+#ifndef SYNERGY_POWER_TRACE_COARSE_STRIDE
+#define SYNERGY_POWER_TRACE_COARSE_STRIDE 256
+#endif
+
+#ifndef SYNERGY_POWER_TRACE_COARSE_CAPACITY
+#define SYNERGY_POWER_TRACE_COARSE_CAPACITY 4096
+#endif
+
+namespace synergy {
+
+struct power_record {
+  std::chrono::steady_clock::time_point time;
+  power power_usage; // microwatts
+  double energy;     // joules consumed since the trace started
+};
+
+namespace detail {
+
+/**
+ * Ring of power records with a single writer; any thread can read the records still in the ring
+ * without locks, retrying when the writer overwrites the records being read.
+ */
+template <std::size_t Capacity>
+class record_ring {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr std::size_t capacity = Capacity;
+
+  // must be called by the writer before the first push
+  void allocate() {
+    if (!slots)
+      slots.reset(new slot[capacity]);
+  }
+
+  void push(const power_record& record) {
+    std::uint64_t h = head.load(std::memory_order_relaxed);
+    reserved.store(h + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot& s = slots[h % capacity];
+    s.time.store(record.time.time_since_epoch().count(), std::memory_order_relaxed);
+    s.power_usage.store(record.power_usage, std::memory_order_relaxed);
+    s.energy.store(record.energy, std::memory_order_relaxed);
+
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  std::optional<power_record> latest() const {
+    for (;;) {
+      std::uint64_t h = head.load(std::memory_order_acquire);
+      if (h == 0)
+        return std::nullopt;
+
+      power_record r = load(h - 1);
+      if (valid(h - 1))
+        return r;
+    }
+  }
+
+  // the records from the last one taken at or before t0 to the first one taken at or after t1
+  std::vector<power_record> records_between(clock::time_point t0, clock::time_point t1) const {
+    for (;;) {
+      std::uint64_t h = head.load(std::memory_order_acquire);
+      std::uint64_t oldest = h > capacity ? h - capacity : 0;
+
+      // first record taken after t0
+      std::uint64_t lo = oldest, hi = h;
+      while (lo < hi) {
+        std::uint64_t mid = lo + (hi - lo) / 2;
+        if (load(mid).time <= t0)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+
+      std::vector<power_record> records;
+      std::uint64_t first = lo > oldest ? lo - 1 : oldest;
+      for (std::uint64_t i = first; i < h; i++) {
+        records.push_back(load(i));
+        if (records.back().time >= t1)
+          break;
+      }
+
+      // the search may have read any record down to the oldest one
+      if (valid(oldest))
+        return records;
+    }
+  }
+
+private:
+  struct slot {
+    std::atomic<clock::rep> time{0};
+    std::atomic<power> power_usage{0};
+    std::atomic<double> energy{0.0};
+  };
+
+  std::unique_ptr<slot[]> slots; // only read after a record has been published
+  std::atomic<std::uint64_t> head = 0;     // records published
+  std::atomic<std::uint64_t> reserved = 0; // records the writer has started to write
+
+  power_record load(std::uint64_t index) const {
+    const slot& s = slots[index % capacity];
+    return power_record{
+        clock::time_point{clock::duration{s.time.load(std::memory_order_relaxed)}},
+        s.power_usage.load(std::memory_order_relaxed),
+        s.energy.load(std::memory_order_relaxed)};
+  }
+
+  // whether the record at index was not overwritten while it was being read
+  bool valid(std::uint64_t index) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return index + capacity >= reserved.load(std::memory_order_relaxed);
+  }
+};
+
+/**
+ * The power records of one device. The sampler of the device is the only writer and allocates the
+ * rings when it starts, so devices that are never sampled take no memory. Windows older than the
+ * full resolution ring are served at a lower resolution from the coarse ring and, beyond it, from
+ * the first record of the trace, so the energy of a window is known however long ago it started.
+ */
+class power_trace {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr std::size_t capacity = SYNERGY_POWER_TRACE_CAPACITY;
+  static constexpr std::size_t coarse_stride = SYNERGY_POWER_TRACE_COARSE_STRIDE;
+
+  power_trace() = default;
+
+  power_trace(const power_trace&) = delete;
+  power_trace& operator=(const power_trace&) = delete;
+
+  // must only be called by the sampler of the device, before its first push
+  void allocate() {
+    fine.allocate();
+    coarse.allocate();
+  }
+
+  // must only be called by the sampler of the device
+  void push(const power_record& record) {
+    if (pushed == 0)
+      origin = record; // published by the push to the fine ring
+    if (pushed % coarse_stride == 0)
+      coarse.push(record);
+    fine.push(record);
+    pushed++;
+  }
+
+  std::optional<power_record> latest() const {
+    return fine.latest();
+  }
+
+  // the records from the last one taken at or before t0 to the first one taken at or after t1
+  std::vector<power_record> records_between(clock::time_point t0, clock::time_point t1) const {
+    auto records = fine.records_between(t0, t1);
+    if (records.empty() || records.front().time <= t0)
+      return records;
+
+    // the window starts before the oldest record of the fine ring
+    auto earlier = coarse.records_between(t0, records.front().time);
+    earlier.erase(std::remove_if(earlier.begin(), earlier.end(), [&](const power_record& r) { return r.time >= records.front().time; }), earlier.end());
+    if ((earlier.empty() || earlier.front().time > t0) && origin.time <= t0)
+      earlier.insert(earlier.begin(), origin);
+
+    earlier.insert(earlier.end(), records.begin(), records.end());
+    return earlier;
+  }
+
+  // joules consumed in [t0, t1]; the window is cut at the latest record
+  double energy_between(clock::time_point t0, clock::time_point t1) const {
+    auto records = records_between(t0, t1);
+    if (records.empty() || t1 <= t0 || t0 >= records.back().time)
+      return 0.0;
+
+    if (records.front().time > t0)
+      throw std::runtime_error("synergy::device error: the window starts before the power trace");
+
+    return energy_at(records, std::min(t1, records.back().time)) - energy_at(records, t0);
+  }
+
+private:
+  record_ring<capacity> fine;
+  record_ring<SYNERGY_POWER_TRACE_COARSE_CAPACITY> coarse;
+  power_record origin{};    // the first record, written once before it is published
+  std::uint64_t pushed = 0; // only accessed by the writer
+
+  // the energy is linear between two records, i.e. the power is constant
+  static double energy_at(const std::vector<power_record>& records, clock::time_point t) {
+    auto next = std::upper_bound(records.begin(), records.end(), t, [](clock::time_point t, const power_record& r) { return t < r.time; });
+    if (next == records.begin())
+      return records.front().energy;
+    if (next == records.end())
+      return records.back().energy;
+
+    auto previous = std::prev(next);
+    double fraction = std::chrono::duration<double>(t - previous->time) / std::chrono::duration<double>(next->time - previous->time);
+    return previous->energy + (next->energy - previous->energy) * fraction;
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
@@ -1,80 +1,119 @@
 #pragma once
 
-#include "profiling_manager.hpp"
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <utility>
+
+#include <sycl/sycl.hpp>
+
+#include "device.hpp"
 #include "host_profiler.hpp"
+#include "kernel.hpp"
+#include "types.hpp"
 
 namespace synergy {
 
 namespace detail {
 
 template <typename Manager>
-class concurrent_kernel_profiler {
+class kernel_profiler {
 public:
-  concurrent_kernel_profiler(Manager& manager, kernel& kernel)
-      : manager{manager}, kernel{kernel} {}
+  kernel_profiler(Manager& manager, sycl::event event, command_kind kind)
+      : manager{manager}, event{event}, kind{kind} {}
 
-  void operator()() {
-    synergy::device& device = manager.device;
-    auto sampling_rate = device.get_power_sampling_rate();
+  double operator()() {
+    double energy = manager.attribution->attribute(event);
+    manager.account(kind, energy);
+    return energy;
+  }
 
-    double energy_sample = 0.0;
-// Wait until start
-#ifdef __HIPSYCL__
-    kernel.event.get_profiling_info<sycl::info::event_profiling::command_start>(); // not working on DPC++ and on HIP with hipSYCL
-#else
-    while (kernel.event.get_info<sycl::info::event::command_execution_status>() == sycl::info::event_command_status::submitted) // not working hipSYCL CUDA and HIP (infinite loop)
-      ;
-#endif
+private:
+  Manager& manager;
+  sycl::event event;
+  command_kind kind;
+};
 
-    while (kernel.event.get_info<sycl::info::event::command_execution_status>() != sycl::info::event_command_status::complete) {
+// integrates the power readings of a device with the trapezoidal rule over the measured elapsed time
+class power_integrator {
+public:
+  using clock = std::chrono::steady_clock;
 
-      energy_sample = device.get_power_usage() / 1000000.0 * sampling_rate / 1000; // Get the integral of the power usage over the interval
-      // std::cout << "power: " << device.get_power_usage() << ", energy: " << energy_sample << "\n";
-      kernel.energy += energy_sample;
+  double add(power sample, clock::time_point time) {
+    double watts = sample / 1000000.0; // microwatts to watts
+    if (!first)
+      energy += (previous_power + watts) / 2 * std::chrono::duration<double>(time - previous_time).count();
 
-      std::this_thread::sleep_for(std::chrono::milliseconds(sampling_rate));
-    }
+    previous_power = watts;
+    previous_time = time;
+    first = false;
+    return energy;
   }
 
 private:
-  Manager& manager;
-  kernel& kernel;
+  double energy = 0.0;
+  double previous_power = 0.0;
+  clock::time_point previous_time;
+  bool first = true;
 };
 
-template <typename Manager>
-class sequential_kernel_profiler {
+// turns the readings of a device energy counter into energy since the first reading and average power
+class energy_counter {
 public:
-  sequential_kernel_profiler(Manager& manager, kernel& kernel)
-      : manager{manager}, kernel{kernel} {}
+  using clock = std::chrono::steady_clock;
 
-  void operator()() {
-    synergy::device& device = manager.device;
-    double energy_sample = 0.0;
+  energy_counter(synergy::energy start, clock::time_point time) : start{start}, previous{start}, previous_time{time} {}
+
+  double energy(synergy::energy reading) const {
+    return (reading - start) / 1000000.0; // microjoules to joules
+  }
 
-#ifdef SYNERGY_LZ_SUPPORT
-    auto start = device.get_energy_usage();
-    while (kernel.event.get_info<sycl::info::event::command_execution_status>() != sycl::info::event_command_status::complete)
-      ;
+  power average_power(synergy::energy reading, clock::time_point time) {
+    double seconds = std::chrono::duration<double>(time - previous_time).count();
+    power average = seconds > 0 ? static_cast<power>((reading - previous) / seconds) : 0; // microwatts
+    previous = reading;
+    previous_time = time;
+    return average;
+  }
 
-    auto end = device.get_energy_usage();
-    energy_sample = (end - start) / 1000000.0; // microjoules to joules
-    kernel.energy = energy_sample;
-#else
-    auto sampling_rate = device.get_power_sampling_rate();
+private:
+  synergy::energy start;
+  synergy::energy previous;
+  clock::time_point previous_time;
+};
+
+// reads the energy counter of a device when it has one, and integrates its power readings otherwise
+class device_meter {
+public:
+  using clock = std::chrono::steady_clock;
 
-    while (kernel.event.get_info<sycl::info::event::command_execution_status>() != sycl::info::event_command_status::complete) {
+  struct reading {
+    clock::time_point time;
+    power sample;
+    double energy; // joules consumed since the meter was created
+  };
 
-      energy_sample = device.get_power_usage() / 1000000.0 * sampling_rate / 1000; // Get the integral of the power usage over the interval
-      kernel.energy += energy_sample;
+  device_meter(synergy::device& device) : device{device} {
+    if (device.has_energy_counter())
+      counter.emplace(device.get_energy_usage(), clock::now());
+  }
 
-      std::this_thread::sleep_for(std::chrono::milliseconds(sampling_rate));
+  // a single vendor query per period: device::sample() would also read clocks, temperature and utilization
+  reading read() {
+    auto now = clock::now();
+    if (counter) {
+      auto energy = device.get_energy_usage();
+      return {now, counter->average_power(energy, now), counter->energy(energy)};
     }
-#endif
+
+    auto sample = device.get_power_usage();
+    return {now, sample, integrator.add(sample, now)};
   }
 
 private:
-  Manager& manager;
-  kernel& kernel;
+  synergy::device& device;
+  std::optional<energy_counter> counter;
+  power_integrator integrator;
 };
 
 template <typename Manager>
@@ -84,26 +123,14 @@ public:
       : manager{manager} {}
 
   void operator()() {
-    synergy::device& device = manager.device;
-
-#ifdef SYNERGY_LZ_SUPPORT
-    auto e_start = device.get_energy_usage();
-
-    while (!manager.finished.load(std::memory_order_acquire)) {
-      auto e_end = device.get_energy_usage();
-      manager.device_energy_consumption = (e_end - e_start) / 1000000.0; // microjoules to joules
-    }
-#else
-    auto sampling_rate = device.get_power_sampling_rate();
-    double energy_sample = 0.0;
+    device_meter meter{manager.device};
 
     while (!manager.finished.load(std::memory_order_acquire)) {
-      energy_sample = device.get_power_usage() / 1000000.0 * sampling_rate / 1000; // Get the integral of the power usage over the interval
-      manager.device_energy_consumption += energy_sample;
+      auto [time, sample, energy] = meter.read();
+      manager.record(time, sample, energy);
 
-      std::this_thread::sleep_for(std::chrono::milliseconds(sampling_rate));
+      manager.timer.wait();
     }
-#endif
   }
 
 private:
@@ -118,38 +145,39 @@ public:
       : manager{manager} {}
   
   void operator()() {
-    synergy::device& device = manager.device;
-    auto eh_start = host_profiler::get_host_energy();
-
-#ifdef SYNERGY_LZ_SUPPORT
-    auto ed_start = device.get_energy_usage();
-
-    while (!manager.finished.load(std::memory_order_acquire)) {
-      auto ed_end = device.get_energy_usage();
-      manager.device_energy_consumption = (ed_end - ed_start) / 1000000.0; // microjoules to joules
-      auto eh_end = host_profiler::get_host_energy();
-      manager.host_energy_consumption = (eh_end - eh_start) / 1000000.0; // microjoules to joules
-    }
+#ifdef SYNERGY_HOST_PROCESS_ATTRIBUTION
+    auto [eh_start, process_start] = host_profiler::get_process_host_energy();
+    ep_start = process_start;
 #else
-    auto sampling_rate = device.get_power_sampling_rate();
-    double energy_sample = 0.0;
+    auto eh_start = host_profiler::get_host_energy();
+#endif
+    device_meter meter{manager.device};
 
     while (!manager.finished.load(std::memory_order_acquire)) {
-      energy_sample = device.get_power_usage() / 1000000.0 * sampling_rate / 1000; // Get the integral of the power usage over the interval
-      manager.device_energy_consumption += energy_sample;
-      auto eh_end = host_profiler::get_host_energy();
-      manager.host_energy_consumption = (eh_end - eh_start) / 1000000.0; // microjoules to joules
+      auto [time, sample, energy] = meter.read();
+      manager.record(time, sample, energy);
+      record_host(eh_start);
 
-      std::this_thread::sleep_for(std::chrono::milliseconds(sampling_rate));
+      manager.timer.wait();
     }
-#endif
   }
 private:
-  /**
-   * @brief Get the host energy value in microjoules
-  */
-
   Manager& manager;
+
+#ifdef SYNERGY_HOST_PROCESS_ATTRIBUTION
+  double ep_start = 0.0;
+
+  void record_host(double eh_start) {
+    auto [eh_end, ep_end] = host_profiler::get_process_host_energy();
+    manager.host_energy_consumption.store((eh_end - eh_start) / 1000000.0, std::memory_order_release); // microjoules to joules
+    manager.process_host_energy_consumption.store((ep_end - ep_start) / 1000000.0, std::memory_order_release);
+  }
+#else
+  void record_host(double eh_start) {
+    auto eh_end = host_profiler::get_host_energy();
+    manager.host_energy_consumption.store((eh_end - eh_start) / 1000000.0, std::memory_order_release); // microjoules to joules
+  }
+#endif
 };
 
 } // namespace detail
@@ -1,12 +1,24 @@
 #pragma once
 
-#include <future>
-#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <vector>
 
 #include "device.hpp"
 #include "kernel.hpp"
+#include "kernel_registry.hpp"
 #include "profilers.hpp"
+#include "runtime.hpp"
+#include "worker_pool.hpp"
+
+// number of threads waiting for the kernels of each queue to complete before attributing their
+// energy; more workers let kernels of out-of-order queues be reported as soon as they complete
+#ifndef SYNERGY_KERNEL_PROFILING_WORKERS
+#define SYNERGY_KERNEL_PROFILING_WORKERS 1
+#endif
 
 namespace synergy {
 
@@ -14,69 +26,128 @@ namespace detail {
 
 class profiling_manager {
 public:
-  friend class concurrent_kernel_profiler<profiling_manager>;
-  friend class sequential_kernel_profiler<profiling_manager>;
-  friend class device_profiler<profiling_manager>;
-  friend class host_device_profiler<profiling_manager>;
+  friend class kernel_profiler<profiling_manager>;
 
-  profiling_manager(device& device) : device{device} {
-#ifdef SYNERGY_DEVICE_PROFILING
-#ifdef SYNERGY_HOST_PROFILING
-    device_profiler = std::thread{detail::host_device_profiler<profiling_manager>{*this}};
-#else
-    device_profiler = std::thread{detail::device_profiler<profiling_manager>{*this}};
-#endif
+  profiling_manager(device& device, const sycl::device& sycl_device) : device{device} {
+#ifdef SYNERGY_KERNEL_PROFILING
+    attribution = runtime::attribution_engine_from(sycl_device);
+    samplers.pin(runtime::topology_from(sycl_device).local_cpus);
 #endif
-  }
-
-  ~profiling_manager() {
-    finished.store(true, std::memory_order_release);
 #ifdef SYNERGY_DEVICE_PROFILING
-    device_profiler.join();
+    if (device.has_energy_counter())
+      counter_baseline = device.get_energy_usage();
+
+    // with an energy counter the sampler is only needed for the host
+    if (!counter_baseline || host_profiling) {
+      telemetry = runtime::telemetry_sampler_from(sycl_device);
+      baseline = telemetry->snapshot();
+    }
 #endif
   }
 
 #ifdef SYNERGY_KERNEL_PROFILING
-  void profile_kernel(sycl::event event) {
-    kernels.push_back(kernel{event});
-    auto future = std::async(std::launch::async, sequential_kernel_profiler<profiling_manager>{*this, kernels.back()});
-    // this will automatically serialize all profiled kernels
-    // since the std::future destructor will wait until the async thread ends
+  // must be taken before the submission of the kernel passed to profile_kernel
+  kernel_reservation reserve_kernel() {
+    return kernel_reservation{attribution};
   }
 
+  void profile_kernel(sycl::event event, kernel_reservation& reservation, command_kind kind = command_kind::compute, double occupancy = 1.0) {
+    reservation.track(event, occupancy);
+    auto energy = samplers.submit(kernel_profiler<profiling_manager>{*this, event, kind});
+    kernels.insert(kernel{event, energy.share(), kind});
+  }
+
+  // waits until the kernel has been profiled
   double kernel_energy(const sycl::event& event) const {
-    kernel dummy{event};
-    auto it = std::find(kernels.begin(), kernels.end(), dummy);
-    if (it == kernels.end()) {
-      throw std::runtime_error("synergy::queue error: kernel was not submitted to the queue");
-    }
+    return kernels.find(event).energy.get();
+  }
+
+  kernel find_kernel(const sycl::event& event) const {
+    return kernels.find(event);
+  }
 
-    return it->energy;
+  // records a kernel profiled by another manager, e.g. after a fallback to a secondary queue
+  void adopt_kernel(const kernel& k) {
+    kernels.insert(k);
+  }
+
+  // waits until every submitted command has been profiled
+  double total_energy(command_kind kind) {
+    samplers.wait_idle();
+
+    std::lock_guard<std::mutex> lock{totals_mutex};
+    return kind == command_kind::compute ? compute_energy : transfer_energy;
+  }
+
+  bool release_kernel(const sycl::event& event) {
+    return kernels.release(event);
+  }
+
+  std::vector<kernel_record> drain_kernels() {
+    return kernels.drain();
+  }
+
+  void set_kernel_retention(kernel_retention retention) {
+    kernels.set_retention(retention);
+  }
+
+  // affects every queue on the same device
+  void set_attribution_rule(attribution_rule rule) {
+    attribution->set_rule(rule);
   }
 #endif
 
 #ifdef SYNERGY_DEVICE_PROFILING
+  // energy consumed since the queue was created, exact up to the call on devices with an energy counter
   double device_energy() const {
-    return device_energy_consumption;
+    if (counter_baseline)
+      return (device.get_energy_usage() - *counter_baseline) / 1000000.0; // microjoules to joules
+    return telemetry->snapshot().device - baseline.device;
   }
 #ifdef SYNERGY_HOST_PROFILING
   double host_energy() const {
-    return host_energy_consumption;
+    return telemetry->snapshot().host - baseline.host;
+  }
+#ifdef SYNERGY_HOST_PROCESS_ATTRIBUTION
+  // the part of host_energy spent on the CPU time of this process
+  double process_host_energy() const {
+    return telemetry->snapshot().process_host - baseline.process_host;
   }
 #endif
 #endif
 
+  std::uint64_t missed_sampling_deadlines() const {
+    return telemetry ? telemetry->missed_deadlines() : 0;
+  }
+#endif
+
 private:
   device device;
-  double device_energy_consumption = 0.0;
-  double host_energy_consumption = 0.0;
-  std::atomic<bool> finished = false;
+#ifdef SYNERGY_DEVICE_PROFILING
+#ifdef SYNERGY_HOST_PROFILING
+  static constexpr bool host_profiling = true;
+#else
+  static constexpr bool host_profiling = false;
+#endif
+  std::shared_ptr<telemetry_sampler> telemetry; // null when the device energy is read from its counter and the host is not profiled
+  energy_snapshot baseline;
+  std::optional<energy> counter_baseline;
+#endif
 #ifdef SYNERGY_KERNEL_PROFILING
-  std::vector<kernel> kernels;
+  std::shared_ptr<attribution_engine> attribution;
+  kernel_registry kernels;
+  double compute_energy = 0.0;
+  double transfer_energy = 0.0;
+  std::mutex totals_mutex;
+
+  void account(command_kind kind, double energy) {
+    std::lock_guard<std::mutex> lock{totals_mutex};
+    (kind == command_kind::compute ? compute_energy : transfer_energy) += energy;
+  }
 #endif
 
-#ifdef SYNERGY_DEVICE_PROFILING
-  std::thread device_profiler;
+#ifdef SYNERGY_KERNEL_PROFILING
+  worker_pool samplers{SYNERGY_KERNEL_PROFILING_WORKERS}; // declared last: drains the pending kernels before the other members are destroyed
 #endif
 };
 
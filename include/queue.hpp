@@ -1,18 +1,41 @@
 #pragma once
 
+#include <algorithm>
+#include <future>
+#include <vector>
+
 #include <sycl/sycl.hpp>
 
+#include "frequency_arbiter.hpp"
 #include "kernel.hpp"
+#include "kernel_policy.hpp"
 #include "profiling_manager.hpp"
 #include "runtime.hpp"
 #include "types.hpp"
 
-#if defined(SYNERGY_DEVICE_PROFILING) || defined(SYNERGY_KERNEL_PROFILING)
-#define SYNERGY_ENABLE_PROFILING
-#endif
-
 namespace synergy {
 
+namespace detail {
+// default kernel name of the queue shortcuts, lets the SYCL implementation name the kernel
+class unnamed_kernel;
+
+template <typename T>
+inline constexpr bool is_dependency_v = std::is_same_v<std::decay_t<T>, sycl::event> || std::is_same_v<std::decay_t<T>, std::vector<sycl::event>>;
+
+// whether the leading arguments of a memory shortcut are the USM pointers of the forms synergy::queue wraps
+template <std::size_t Pointers, typename... Args>
+struct leading_pointers : std::false_type {};
+
+template <typename First, typename... Rest>
+struct leading_pointers<1, First, Rest...> : std::is_pointer<std::decay_t<First>> {};
+
+template <typename First, typename Second, typename... Rest>
+struct leading_pointers<2, First, Second, Rest...> : std::bool_constant<std::is_pointer_v<std::decay_t<First>> && std::is_pointer_v<std::decay_t<Second>>> {};
+
+template <std::size_t Pointers, typename... Args>
+inline constexpr bool leading_pointers_v = leading_pointers<Pointers, Args...>::value;
+} // namespace detail
+
 class queue : public sycl::queue {
 public:
 #ifdef SYNERGY_ENABLE_PROFILING
@@ -20,7 +43,8 @@ public:
   queue(Rest&&... args)
       : sycl::queue(synergy::queue::check_args(std::forward<Rest>(args)...)),
         device{synergy::detail::runtime::synergy_device_from(get_device())},
-        profiling{std::make_shared<detail::profiling_manager>(device)} {
+        scaling{std::make_shared<detail::frequency_requester>(synergy::detail::runtime::frequency_arbiter_from(get_device()))},
+        profiling{std::make_shared<detail::profiling_manager>(device, get_device())} {
     assert_profiling_properties();
   }
 
@@ -28,21 +52,24 @@ public:
   queue(frequency uncore_frequency, frequency core_frequency, Rest&&... args)
       : sycl::queue(synergy::queue::check_args(std::forward<Rest>(args)...)),
         device{synergy::detail::runtime::synergy_device_from(get_device())},
+        scaling{std::make_shared<detail::frequency_requester>(synergy::detail::runtime::frequency_arbiter_from(get_device()))},
         core_target_frequency{core_frequency},
         uncore_target_frequency{uncore_frequency},
-        profiling{std::make_shared<detail::profiling_manager>(device)} {
+        profiling{std::make_shared<detail::profiling_manager>(device, get_device())} {
     assert_profiling_properties();
   }
 #else
   template <typename... Rest>
   queue(Rest&&... args)
       : sycl::queue(synergy::queue::check_args(std::forward<Rest>(args)...)),
-        device{synergy::detail::runtime::synergy_device_from(get_device())} {}
+        device{synergy::detail::runtime::synergy_device_from(get_device())},
+        scaling{std::make_shared<detail::frequency_requester>(synergy::detail::runtime::frequency_arbiter_from(get_device()))} {}
 
   template <typename... Rest>
   queue(frequency uncore_frequency, frequency core_frequency, Rest&&... args)
       : sycl::queue(synergy::queue::check_args(std::forward<Rest>(args)...)),
         device{synergy::detail::runtime::synergy_device_from(get_device())},
+        scaling{std::make_shared<detail::frequency_requester>(synergy::detail::runtime::frequency_arbiter_from(get_device()))},
         core_target_frequency{core_frequency},
         uncore_target_frequency{uncore_frequency} {}
 #endif
@@ -63,69 +90,193 @@ public:
 
   template <typename T>
   sycl::event submit(T cfg) {
-    sycl::event event;
+    return submit_command(cfg, command_kind::compute);
+  }
 
-    if (has_target()) {
-      event = sycl::queue::submit(
-          [&](sycl::handler& h) {
-            try {
-              if (core_target_frequency) device.set_core_frequency(core_target_frequency);
-              if (uncore_target_frequency) device.set_uncore_frequency(uncore_target_frequency);
-            } catch (const std::exception& e) {
-              std::cerr << e.what() << '\n';
-            }
-            cfg(h);
-          }
-      );
+  template <typename T>
+  sycl::event submit(frequency kernel_uncore_frequency, frequency kernel_core_frequency, T cfg) {
+    return scale_and_submit(kernel_uncore_frequency, kernel_core_frequency, cfg, command_kind::compute);
+  }
 
-#ifdef SYNERGY_KERNEL_PROFILING
-      profiling->profile_kernel(event);
-#endif
-      event.wait_and_throw(); // we always have to do this because kernel submit time can be different from kernel execution time
-    } else {
-      event = sycl::queue::submit(cfg);
+  // frequencies bound at compile time through synergy::kernel_policy
+  template <typename Policy, typename T>
+  sycl::event submit(T cfg) {
+    static_assert(detail::is_kernel_policy_v<Policy>, "synergy::queue error: submit<Policy> requires a synergy::kernel_policy");
+    return scale_and_submit(Policy::uncore_frequency, Policy::core_frequency, cfg, command_kind::compute);
+  }
+
+  // same fallback semantics of sycl::queue, but the secondary queue applies its own frequency targets
+  // and the energy is measured on the device that runs the kernel; only errors of the submission
+  // fall back, the asynchronous errors of a kernel that was submitted are not retried
+  template <typename T>
+  sycl::event submit(T cfg, const queue& secondary_queue) {
+    submission primary;
+    try {
+      primary = enqueue_command(cfg, command_kind::compute);
+    } catch (const sycl::exception&) {
+      queue secondary{secondary_queue};
+      sycl::event event = secondary.submit(cfg);
 
 #ifdef SYNERGY_KERNEL_PROFILING
-#ifdef __HIPSYCL__
-      get_context().hipSYCL_runtime()->dag().flush_sync();
-#endif
-      profiling->profile_kernel(event);
-      event.wait_and_throw();
+      // let the kernel energy be queried from either queue
+      profiling->adopt_kernel(secondary.profiling->find_kernel(event));
 #endif
+      return event;
     }
+    return complete(primary);
+  }
+
+  // shortcuts of sycl::queue, routed through submit to get the same scaling and profiling;
+  // a synergy::kernel_policy as kernel name sets the frequencies of the kernel. Memory operations
+  // are only scaled, and then waited for like scaled kernels, when transfer frequencies are set
+
+  template <typename KernelName = detail::unnamed_kernel, typename KernelType>
+  sycl::event single_task(const KernelType& kernel) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) { single_task_in<KernelName>(h, kernel); });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, typename KernelType>
+  sycl::event single_task(sycl::event dependency, const KernelType& kernel) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) {
+      h.depends_on(dependency);
+      single_task_in<KernelName>(h, kernel);
+    });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, typename KernelType>
+  sycl::event single_task(const std::vector<sycl::event>& dependencies, const KernelType& kernel) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      single_task_in<KernelName>(h, kernel);
+    });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, int Dims, typename First, typename... Rest>
+  std::enable_if_t<!detail::is_dependency_v<First>, sycl::event> parallel_for(sycl::range<Dims> range, First&& first, Rest&&... rest) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) { parallel_for_in<KernelName>(h, range, first, rest...); });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, int Dims, typename... Rest>
+  sycl::event parallel_for(sycl::range<Dims> range, sycl::event dependency, Rest&&... rest) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) {
+      h.depends_on(dependency);
+      parallel_for_in<KernelName>(h, range, rest...);
+    });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, int Dims, typename... Rest>
+  sycl::event parallel_for(sycl::range<Dims> range, const std::vector<sycl::event>& dependencies, Rest&&... rest) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      parallel_for_in<KernelName>(h, range, rest...);
+    });
+  }
+
+  // an integer is a one-dimensional range, as for sycl::queue
+  template <typename KernelName = detail::unnamed_kernel, typename First, typename... Rest>
+  std::enable_if_t<!detail::is_dependency_v<First>, sycl::event> parallel_for(std::size_t range, First&& first, Rest&&... rest) {
+    return parallel_for<KernelName>(sycl::range<1>{range}, std::forward<First>(first), std::forward<Rest>(rest)...);
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, typename... Rest>
+  sycl::event parallel_for(std::size_t range, sycl::event dependency, Rest&&... rest) {
+    return parallel_for<KernelName>(sycl::range<1>{range}, dependency, std::forward<Rest>(rest)...);
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, typename... Rest>
+  sycl::event parallel_for(std::size_t range, const std::vector<sycl::event>& dependencies, Rest&&... rest) {
+    return parallel_for<KernelName>(sycl::range<1>{range}, dependencies, std::forward<Rest>(rest)...);
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, int Dims, typename First, typename... Rest>
+  std::enable_if_t<!detail::is_dependency_v<First>, sycl::event> parallel_for(sycl::nd_range<Dims> range, First&& first, Rest&&... rest) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) { parallel_for_in<KernelName>(h, range, first, rest...); });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, int Dims, typename... Rest>
+  sycl::event parallel_for(sycl::nd_range<Dims> range, sycl::event dependency, Rest&&... rest) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) {
+      h.depends_on(dependency);
+      parallel_for_in<KernelName>(h, range, rest...);
+    });
+  }
+
+  template <typename KernelName = detail::unnamed_kernel, int Dims, typename... Rest>
+  sycl::event parallel_for(sycl::nd_range<Dims> range, const std::vector<sycl::event>& dependencies, Rest&&... rest) {
+    return submit_kernel<KernelName>([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      parallel_for_in<KernelName>(h, range, rest...);
+    });
+  }
+
+  sycl::event memcpy(void* dest, const void* src, size_t num_bytes, const std::vector<sycl::event>& dependencies = {}) {
+    return submit_command([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      h.memcpy(dest, src, num_bytes);
+    }, command_kind::transfer);
+  }
 
-    return event;
+  sycl::event memcpy(void* dest, const void* src, size_t num_bytes, sycl::event dependency) {
+    return memcpy(dest, src, num_bytes, std::vector<sycl::event>{dependency});
+  }
+
+  sycl::event memset(void* ptr, int value, size_t num_bytes, const std::vector<sycl::event>& dependencies = {}) {
+    return submit_command([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      h.memset(ptr, value, num_bytes);
+    }, command_kind::transfer);
+  }
+
+  sycl::event memset(void* ptr, int value, size_t num_bytes, sycl::event dependency) {
+    return memset(ptr, value, num_bytes, std::vector<sycl::event>{dependency});
   }
 
   template <typename T>
-  sycl::event submit(frequency kernel_uncore_frequency, frequency kernel_core_frequency, T cfg) {
-    sycl::event event = sycl::queue::submit(
-        [&](sycl::handler& h) {
-          try {
-            if (kernel_core_frequency) device.set_core_frequency(kernel_core_frequency);
-            if (kernel_uncore_frequency) device.set_uncore_frequency(kernel_uncore_frequency);
-          } catch (const std::exception& e) {
-            std::cerr << e.what() << '\n';
-          }
-          cfg(h);
-        }
-    );
+  sycl::event fill(void* ptr, const T& pattern, size_t count, const std::vector<sycl::event>& dependencies = {}) {
+    return submit_command([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      h.fill(ptr, pattern, count);
+    }, command_kind::transfer);
+  }
 
-#ifdef SYNERGY_KERNEL_PROFILING
-#ifdef __HIPSYCL__
-    get_context().hipSYCL_runtime()->dag().flush_sync();
-#endif
-    profiling->profile_kernel(event);
-#endif
+  template <typename T>
+  sycl::event fill(void* ptr, const T& pattern, size_t count, sycl::event dependency) {
+    return fill(ptr, pattern, count, std::vector<sycl::event>{dependency});
+  }
 
-    event.wait_and_throw(); // if we do frequency scaling we always wait
-    return event;
+  template <typename T>
+  sycl::event copy(const T* src, T* dest, size_t count, const std::vector<sycl::event>& dependencies = {}) {
+    return submit_command([&](sycl::handler& h) {
+      h.depends_on(dependencies);
+      h.copy(src, dest, count);
+    }, command_kind::transfer);
   }
 
   template <typename T>
-  sycl::event submit(T cfg, const queue& secondary_queue) {
-    std::cerr << "synergy::queue info: submission with secondary queue does not support energy profiling or frequency scaling\n";
-    sycl::queue::submit(cfg, secondary_queue);
+  sycl::event copy(const T* src, T* dest, size_t count, sycl::event dependency) {
+    return copy(src, dest, count, std::vector<sycl::event>{dependency});
+  }
+
+  // the other forms of sycl::queue, e.g. with accessors or implementation extensions, are neither scaled nor profiled
+
+  template <typename... Args, typename = std::enable_if_t<!detail::leading_pointers_v<2, Args...>>>
+  decltype(auto) memcpy(Args&&... args) {
+    return sycl::queue::memcpy(std::forward<Args>(args)...);
+  }
+
+  template <typename... Args, typename = std::enable_if_t<!detail::leading_pointers_v<1, Args...>>>
+  decltype(auto) memset(Args&&... args) {
+    return sycl::queue::memset(std::forward<Args>(args)...);
+  }
+
+  template <typename... Args, typename = std::enable_if_t<!detail::leading_pointers_v<1, Args...>>>
+  decltype(auto) fill(Args&&... args) {
+    return sycl::queue::fill(std::forward<Args>(args)...);
+  }
+
+  template <typename... Args, typename = std::enable_if_t<!detail::leading_pointers_v<2, Args...>>>
+  decltype(auto) copy(Args&&... args) {
+    return sycl::queue::copy(std::forward<Args>(args)...);
   }
 
   inline device get_synergy_device() const {
@@ -137,10 +288,78 @@ public:
     uncore_target_frequency = uncore_frequency;
   }
 
+  // frequencies of the memcpy, memset, fill and copy shortcuts, which are not scaled by default
+  inline void set_transfer_frequencies(frequency uncore_frequency, frequency core_frequency) {
+    core_transfer_frequency = core_frequency;
+    uncore_transfer_frequency = uncore_frequency;
+  }
+
+  // withdraws the standing frequency request of the queue, after the scaled kernels already submitted
+  // with SYNERGY_ASYNC_SCALING; the device keeps its frequencies unless another queue requests others
+  inline void release_frequencies() {
+#ifdef SYNERGY_ASYNC_SCALING
+    last_scaled_event = sycl::queue::submit([&](sycl::handler& h) {
+      h.depends_on(last_scaled_event);
+      h.host_task([scaling = scaling]() { release_request(*scaling); });
+    });
+    last_scaled_uncore = last_scaled_core = 0;
+#else
+    release_request(*scaling);
+#endif
+  }
+
+  // used by the device arbiter when the policy is arbitration_policy::priority
+  inline void set_frequency_priority(int priority) {
+    scaling->set_priority(priority);
+  }
+
+  // the policy is shared by all the queues on the same device
+  inline void set_arbitration_policy(arbitration_policy policy) {
+    scaling->set_policy(policy);
+  }
+
+  inline arbitration_policy get_arbitration_policy() const {
+    return scaling->get_policy();
+  }
+
 #ifdef SYNERGY_KERNEL_PROFILING
   inline double kernel_energy_consumption(const sycl::event& event) const {
     return profiling->kernel_energy(event);
   }
+
+  // energy of every kernel submitted to the queue, waits until all of them have been profiled
+  inline double total_kernel_energy_consumption() {
+    return profiling->total_energy(command_kind::compute);
+  }
+
+  // energy of every memcpy, memset, fill and copy submitted to the queue
+  inline double total_transfer_energy_consumption() {
+    return profiling->total_energy(command_kind::transfer);
+  }
+
+  // drops the energy record of the kernel, returns false if it was not found
+  inline bool release_kernel(const sycl::event& event) {
+    return profiling->release_kernel(event);
+  }
+
+  // removes and returns the records of the kernels that have already been profiled
+  inline std::vector<kernel_record> drain_kernel_energy_consumptions() {
+    return profiling->drain_kernels();
+  }
+
+  inline void set_kernel_retention(kernel_retention retention) {
+    profiling->set_kernel_retention(retention);
+  }
+
+  // selects how the energy of kernels overlapping in time is split, for every queue on the same device
+  inline void set_attribution_rule(attribution_rule rule) {
+    profiling->set_attribution_rule(rule);
+  }
+
+  // relative share of the device used by the kernels submitted from now on, for attribution_rule::occupancy
+  inline void set_occupancy_hint(double occupancy) {
+    occupancy_hint = occupancy;
+  }
 #endif
 
 #ifdef SYNERGY_DEVICE_PROFILING
@@ -151,19 +370,210 @@ public:
   inline double host_energy_consumption() const {
     return profiling->host_energy();
   }
+#ifdef SYNERGY_HOST_PROCESS_ATTRIBUTION
+  // host energy split by the share of CPU time of this process on each socket, excludes co-scheduled jobs
+  inline double process_host_energy_consumption() const {
+    return profiling->process_host_energy();
+  }
 #endif
 #endif
 
+  // sampling periods of the device sampler that were skipped because the sensors were too slow to read
+  inline std::uint64_t missed_sampling_deadlines() const {
+    return profiling->missed_sampling_deadlines();
+  }
+#endif
+
 private:
   device device;
+  std::shared_ptr<detail::frequency_requester> scaling;
   frequency core_target_frequency = 0;
   frequency uncore_target_frequency = 0;
+  frequency core_transfer_frequency = 0;
+  frequency uncore_transfer_frequency = 0;
 
 #ifdef SYNERGY_ENABLE_PROFILING
   std::shared_ptr<detail::profiling_manager> profiling;
 #endif
+#ifdef SYNERGY_KERNEL_PROFILING
+  double occupancy_hint = 1.0;
+#endif
+
+#ifdef SYNERGY_ASYNC_SCALING
+  sycl::event last_scaled_event;
+  frequency last_scaled_uncore = 0; // targets requested by the host task before last_scaled_event, 0 for none
+  frequency last_scaled_core = 0;
+#else
+  static constexpr std::size_t unchanged_kernels_pruned = 64; // completed kernels are dropped from the list at this size
+  std::vector<sycl::event> unchanged_kernels;                 // scaled kernels submitted since the clocks last changed
+#endif
+
+
+  static inline void apply_frequencies(detail::frequency_requester& scaling, frequency uncore_frequency, frequency core_frequency) {
+    try {
+      scaling.request_frequencies(uncore_frequency, core_frequency);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+    }
+  }
+
+  // a submitted command; without SYNERGY_ASYNC_SCALING a scaled one must complete before the clocks can change again
+  struct submission {
+    sycl::event event;
+    bool scaled = false;
+  };
+
+  static inline void release_request(detail::frequency_requester& scaling) {
+    try {
+      scaling.release_frequencies();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+    }
+  }
 
-  inline bool has_target() { return core_target_frequency != 0 || uncore_target_frequency != 0; }
+  template <typename T>
+  sycl::event submit_command(T cfg, command_kind kind) {
+    return complete(enqueue_command(cfg, kind));
+  }
+
+  template <typename T>
+  submission enqueue_command(T& cfg, command_kind kind) {
+    frequency core = kind == command_kind::compute ? core_target_frequency : core_transfer_frequency;
+    frequency uncore = kind == command_kind::compute ? uncore_target_frequency : uncore_transfer_frequency;
+    if (core != 0 || uncore != 0)
+      return enqueue_scaled(uncore, core, cfg, kind);
+
+#ifdef SYNERGY_KERNEL_PROFILING
+    auto reservation = profiling->reserve_kernel();
+#endif
+    sycl::event event = sycl::queue::submit(cfg);
+    if (kind == command_kind::compute)
+      detail::submitted_kernels++;
+
+#ifdef SYNERGY_KERNEL_PROFILING
+    profiling->profile_kernel(event, reservation, kind, occupancy_hint);
+#endif
+    return submission{event};
+  }
+
+  template <typename KernelName, typename T>
+  sycl::event submit_kernel(T cfg) {
+    if constexpr (detail::is_kernel_policy_v<KernelName>)
+      return scale_and_submit(KernelName::uncore_frequency, KernelName::core_frequency, cfg, command_kind::compute);
+    else
+      return submit_command(cfg, command_kind::compute);
+  }
+
+  template <typename KernelName, typename... Args>
+  static void single_task_in(sycl::handler& h, Args&&... args) {
+    using name = detail::kernel_name_of_t<KernelName>;
+    if constexpr (std::is_same_v<name, detail::unnamed_kernel>)
+      h.single_task(std::forward<Args>(args)...);
+    else
+      h.template single_task<name>(std::forward<Args>(args)...);
+  }
+
+  template <typename KernelName, typename... Args>
+  static void parallel_for_in(sycl::handler& h, Args&&... args) {
+    using name = detail::kernel_name_of_t<KernelName>;
+    if constexpr (std::is_same_v<name, detail::unnamed_kernel>)
+      h.parallel_for(std::forward<Args>(args)...);
+    else
+      h.template parallel_for<name>(std::forward<Args>(args)...);
+  }
+
+  template <typename T>
+  sycl::event scale_and_submit(frequency uncore_frequency, frequency core_frequency, T& cfg, command_kind kind) {
+    return complete(enqueue_scaled(uncore_frequency, core_frequency, cfg, kind));
+  }
+
+  template <typename T>
+  submission enqueue_scaled(frequency uncore_frequency, frequency core_frequency, T& cfg, command_kind kind) {
+#ifdef SYNERGY_KERNEL_PROFILING
+    auto reservation = profiling->reserve_kernel();
+#endif
+#ifdef SYNERGY_ASYNC_SCALING
+    // the frequency change is a host task in the DAG, so it runs when the kernel is about to execute
+    // and the host does not have to wait; chaining it after the previous scaled kernel keeps
+    // out-of-order queues from changing clocks under a kernel that is still running. It is skipped
+    // when the submission of the kernel fails, e.g. before falling back to a secondary queue, and
+    // when the queue already requested the same frequencies, so back-to-back kernels at the same
+    // frequencies are only ordered, without a round trip to the host
+    sycl::event event;
+    if (uncore_frequency == last_scaled_uncore && core_frequency == last_scaled_core) {
+      event = sycl::queue::submit([&](sycl::handler& h) {
+        h.depends_on(last_scaled_event);
+        cfg(h);
+      });
+    } else {
+      std::promise<bool> kernel_submitted;
+      std::shared_future<bool> kernel_submitted_future = kernel_submitted.get_future().share();
+      sycl::event scaling_event = sycl::queue::submit([&](sycl::handler& h) {
+        h.depends_on(last_scaled_event);
+        h.host_task([scaling = scaling, uncore_frequency, core_frequency, kernel_submitted_future]() {
+          if (kernel_submitted_future.get())
+            apply_frequencies(*scaling, uncore_frequency, core_frequency);
+        });
+      });
+
+      try {
+        event = sycl::queue::submit([&](sycl::handler& h) {
+          h.depends_on(scaling_event);
+          cfg(h);
+        });
+      } catch (...) {
+        kernel_submitted.set_value(false);
+        throw;
+      }
+      kernel_submitted.set_value(true);
+      last_scaled_uncore = uncore_frequency;
+      last_scaled_core = core_frequency;
+    }
+    last_scaled_event = event;
+#else
+    // a kernel is only waited for when its targets change the clocks, targets that are not supported
+    // frequencies always count as a change; the kernels that ran at unchanged clocks must complete
+    // before the clocks change under them
+    bool change = (core_frequency != 0 && core_frequency != device.get_core_frequency()) ||
+                  (uncore_frequency != 0 && uncore_frequency != device.get_uncore_frequency());
+    if (change) {
+      sycl::event::wait(unchanged_kernels);
+      unchanged_kernels.clear();
+    }
+
+    sycl::event event = sycl::queue::submit([&](sycl::handler& h) {
+      apply_frequencies(*scaling, uncore_frequency, core_frequency);
+      cfg(h);
+    });
+
+    if (!change) {
+      if (unchanged_kernels.size() >= unchanged_kernels_pruned)
+        unchanged_kernels.erase(std::remove_if(unchanged_kernels.begin(), unchanged_kernels.end(), [](const sycl::event& e) {
+          return e.get_info<sycl::info::event::command_execution_status>() == sycl::info::event_command_status::complete;
+        }), unchanged_kernels.end());
+      unchanged_kernels.push_back(event);
+    }
+#endif
+    if (kind == command_kind::compute)
+      detail::submitted_kernels++;
+
+#ifdef SYNERGY_KERNEL_PROFILING
+    profiling->profile_kernel(event, reservation, kind, occupancy_hint);
+#endif
+#ifdef SYNERGY_ASYNC_SCALING
+    return submission{event, true};
+#else
+    return submission{event, change};
+#endif
+  }
+
+  static sycl::event complete(submission s) {
+#ifndef SYNERGY_ASYNC_SCALING
+    if (s.scaled)
+      s.event.wait_and_throw(); // kernel submit time can be different from kernel execution time, so we wait before changing frequency again
+#endif
+    return s.event;
+  }
 
   template <typename... Args>
   static sycl::queue check_args(Args&&... args) {
@@ -186,12 +596,11 @@ private:
 #endif
   }
 
+  // out-of-order queues are allowed: overlapping kernels share the device energy through the attribution engine
   inline void assert_profiling_properties() {
 #ifdef SYNERGY_KERNEL_PROFILING
     if (!has_property<sycl::property::queue::enable_profiling>())
       throw std::runtime_error("synergy::queue error: queue must be constructed with the enable_profiling property");
-    if (!has_property<sycl::property::queue::in_order>())
-      throw std::runtime_error("synergy::queue error: queue must be constructed with the in_order property");
 #endif
   }
 };
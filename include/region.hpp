@@ -0,0 +1,169 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "kernel.hpp"
+#include "runtime.hpp"
+#include "types.hpp"
+#ifdef SYNERGY_HOST_PROFILING
+#include "host_profiler.hpp"
+#endif
+
+namespace synergy {
+
+struct region_stats {
+  std::string name;
+  std::uint64_t count = 0;    // completed executions of the region
+  double wall_time = 0.0;     // seconds
+  double device_energy = 0.0; // joules, summed over the devices with an energy counter or profiled by a synergy::queue
+  double host_energy = 0.0;   // joules, with SYNERGY_HOST_PROFILING
+  std::uint64_t kernels = 0;  // kernels submitted by the thread that opened the region
+};
+
+namespace detail {
+
+/**
+ * Aggregates the regions of every thread by name. Opening a region only pushes a reading onto a
+ * stack of the calling thread; the totals are locked once, when the region ends. Nested regions
+ * are inclusive: the energy of an inner region is also counted in the enclosing ones.
+ */
+class region_registry {
+public:
+  using clock = std::chrono::steady_clock;
+
+  static region_registry& get() {
+    static region_registry r;
+    return r;
+  }
+
+  void begin(std::string name) {
+    open_regions().push_back(open_region{std::move(name), read()});
+  }
+
+  void end(const std::string* expected_name) {
+    auto& stack = open_regions();
+    if (stack.empty())
+      throw std::runtime_error("synergy::region error: no open region on this thread");
+    if (expected_name && *expected_name != stack.back().name)
+      throw std::runtime_error("synergy::region error: region \"" + *expected_name + "\" ended while \"" + stack.back().name + "\" is open");
+
+    reading now = read();
+    open_region region = std::move(stack.back());
+    stack.pop_back();
+
+    std::lock_guard<std::mutex> lock{mutex};
+    region_stats& stats = regions[region.name];
+    stats.name = region.name;
+    stats.count++;
+    stats.wall_time += std::chrono::duration<double>(now.time - region.start.time).count();
+    stats.device_energy += now.device_energy - region.start.device_energy;
+    stats.host_energy += now.host_energy - region.start.host_energy;
+    stats.kernels += now.kernels - region.start.kernels;
+  }
+
+  std::vector<region_stats> snapshot() {
+    std::lock_guard<std::mutex> lock{mutex};
+    std::vector<region_stats> all;
+    all.reserve(regions.size());
+    for (const auto& [name, stats] : regions)
+      all.push_back(stats);
+    return all;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock{mutex};
+    regions.clear();
+  }
+
+private:
+  struct reading {
+    clock::time_point time;
+    double device_energy;
+    double host_energy;
+    std::uint64_t kernels;
+  };
+
+  struct open_region {
+    std::string name;
+    reading start;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, region_stats> regions;
+
+  region_registry() = default;
+
+  static std::vector<open_region>& open_regions() {
+    static thread_local std::vector<open_region> stack;
+    return stack;
+  }
+
+  static reading read() {
+    double device_energy = 0.0;
+#ifdef SYNERGY_ENABLE_PROFILING
+    // devices with an energy counter may have no sampler, see profiling_manager
+    for (const auto& device : runtime::synergy_devices())
+      device_energy += device.has_energy_counter() ? device.get_energy_usage() / 1000000.0 : device.get_recorded_energy(); // microjoules to joules
+#endif
+
+    double host_energy = 0.0;
+#ifdef SYNERGY_HOST_PROFILING
+    host_energy = host_profiler::get_host_energy() / 1000000.0; // microjoules to joules
+#endif
+
+    return reading{clock::now(), device_energy, host_energy, submitted_kernels};
+  }
+};
+
+} // namespace detail
+
+inline void region_begin(std::string name) {
+  detail::region_registry::get().begin(std::move(name));
+}
+
+// ends the innermost region opened by the calling thread
+inline void region_end() {
+  detail::region_registry::get().end(nullptr);
+}
+
+// ends the innermost region opened by the calling thread, which must be the named one
+inline void region_end(const std::string& name) {
+  detail::region_registry::get().end(&name);
+}
+
+// totals of the regions ended so far, one entry per name
+inline std::vector<region_stats> region_snapshot() {
+  return detail::region_registry::get().snapshot();
+}
+
+inline void region_reset() {
+  detail::region_registry::get().reset();
+}
+
+class region {
+public:
+  region(std::string name) : name{name} { region_begin(std::move(name)); }
+
+  region(const region&) = delete;
+  region& operator=(const region&) = delete;
+
+  ~region() {
+    try {
+      region_end(name);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+    }
+  }
+
+private:
+  std::string name;
+};
+
+} // namespace synergy
@@ -1,11 +1,27 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
+#include <vector>
 
 #include <sycl/sycl.hpp>
 
 #include "device.hpp"
+#include "frequency_arbiter.hpp"
+#include "topology.hpp"
+#ifdef SYNERGY_ENABLE_PROFILING
+#include "telemetry_sampler.hpp"
+#endif
+#ifdef SYNERGY_KERNEL_PROFILING
+#include "energy_attribution.hpp"
+#endif
 #include "vendor_implementations.hpp"
 
 namespace synergy {
@@ -15,14 +31,77 @@ namespace detail {
 class runtime {
 public:
   static synergy::device synergy_device_from(const sycl::device& sycl_device) {
-    static runtime r;
+    return get().entry_from(sycl_device).device;
+  }
 
-    auto search = r.devices.find(sycl_device);
-    if (search == r.devices.end())
-      throw std::runtime_error("error while assigning synergy::device to queue: sycl::device not supported");
+  static std::shared_ptr<frequency_arbiter> frequency_arbiter_from(const sycl::device& sycl_device) {
+    return get().entry_from(sycl_device).arbiter;
+  }
+
+  // NUMA node and local CPUs of the device, known without setting it up
+  static const device_topology& topology_from(const sycl::device& sycl_device) {
+    return get().registered_entry(sycl_device).topology;
+  }
+
+  // the devices used so far, each physical device once
+  static std::vector<synergy::device> synergy_devices() {
+    std::vector<synergy::device> all;
+    for (const auto& entry : get().unique_entries())
+      if (entry->ready.load(std::memory_order_acquire))
+        all.push_back(entry->device);
+    return all;
+  }
+
+  // sets up every supported device in parallel, instead of each one on its first use;
+  // devices that cannot be set up, e.g. because their vendor library is missing, are reported and skipped
+  static void preload_devices() {
+    runtime& r = get();
+    std::vector<std::future<void>> pending;
+    for (const auto& entry : r.unique_entries())
+      pending.push_back(std::async(std::launch::async, [&r, entry] { r.materialize(*entry); }));
+
+    for (auto& p : pending) {
+      try {
+        p.get();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+      }
+    }
+  }
 
-    return search->second;
+#ifdef SYNERGY_ENABLE_PROFILING
+  // one sampler per physical device, shared by all its queues and stopped when the last one is destroyed;
+  // the power trace it records outlives it in the synergy::device
+  static std::shared_ptr<telemetry_sampler> telemetry_sampler_from(const sycl::device& sycl_device) {
+    runtime& r = get();
+    device_entry& entry = r.entry_from(sycl_device);
+
+    std::lock_guard<std::mutex> lock{r.components_mutex};
+    auto sampler = entry.sampler.lock();
+    if (!sampler) {
+      sampler = std::make_shared<telemetry_sampler>(entry.device, entry.topology);
+      entry.sampler = sampler;
+    }
+    return sampler;
   }
+#endif
+
+#ifdef SYNERGY_KERNEL_PROFILING
+  // created on first use and destroyed, together with its sampler, when no queue uses it anymore
+  static std::shared_ptr<attribution_engine> attribution_engine_from(const sycl::device& sycl_device) {
+    runtime& r = get();
+    device_entry& entry = r.entry_from(sycl_device);
+    auto telemetry = telemetry_sampler_from(sycl_device);
+
+    std::lock_guard<std::mutex> lock{r.components_mutex};
+    auto engine = entry.engine.lock();
+    if (!engine) {
+      engine = std::make_shared<attribution_engine>(entry.device, sycl_device, telemetry);
+      entry.engine = engine;
+    }
+    return engine;
+  }
+#endif
 
   runtime(runtime const&) = delete;
   runtime(runtime&&) = delete;
@@ -30,10 +109,82 @@ public:
   runtime& operator=(runtime&&) = delete;
 
 private:
-  std::unordered_map<sycl::device, synergy::device> devices;
+  struct device_entry {
+    std::function<std::shared_ptr<device_impl>()> create;
+    std::once_flag created;
+    std::atomic<bool> ready = false;
+    device_topology topology;
+
+    synergy::device device;
+    std::shared_ptr<frequency_arbiter> arbiter;
+#ifdef SYNERGY_KERNEL_PROFILING
+    std::weak_ptr<attribution_engine> engine;
+#endif
+#ifdef SYNERGY_ENABLE_PROFILING
+    std::weak_ptr<telemetry_sampler> sampler;
+#endif
+  };
+
+  // filled by the constructor and never modified afterwards; entries are shared by the SYCL devices of different platforms exposing the same hardware
+  std::unordered_map<sycl::device, std::shared_ptr<device_entry>> devices;
+  std::mutex components_mutex; // guards the components created on first use
+
+  static runtime& get() {
+    static runtime r;
+    return r;
+  }
+
+  device_entry& registered_entry(const sycl::device& sycl_device) {
+    auto search = devices.find(sycl_device);
+    if (search == devices.end())
+      throw std::runtime_error("error while assigning synergy::device to queue: sycl::device not supported");
+    return *search->second;
+  }
+
+  device_entry& entry_from(const sycl::device& sycl_device) {
+    device_entry& entry = registered_entry(sycl_device);
+    materialize(entry);
+    return entry;
+  }
+
+  // the vendor library and the device are set up on the first lookup; a failed attempt is retried on the next one
+  void materialize(device_entry& entry) {
+    std::call_once(entry.created, [&entry] {
+      synergy::device device{entry.create()};
+      entry.device = device;
+      entry.arbiter = std::make_shared<frequency_arbiter>(device);
+      entry.ready.store(true, std::memory_order_release);
+    });
+  }
+
+  std::vector<std::shared_ptr<device_entry>> unique_entries() const {
+    std::vector<std::shared_ptr<device_entry>> entries;
+    for (const auto& [sycl_device, entry] : devices)
+      if (std::find(entries.begin(), entries.end(), entry) == entries.end())
+        entries.push_back(entry);
+    return entries;
+  }
+
+  void register_device(const sycl::device& sycl_device, std::function<std::shared_ptr<device_impl>()> create, std::optional<pci_address> address = std::nullopt) {
+    auto entry = std::make_shared<device_entry>();
+    entry->create = std::move(create);
+    if (address)
+      entry->topology = device_topology::of(*address);
+    devices.insert({sycl_device, entry});
+  }
+
+  // only DPC++ reports the PCI address of a device; without it the vendor device is looked up by enumeration index
+  static std::optional<pci_address> pci_address_of([[maybe_unused]] const sycl::device& sycl_device) {
+#ifdef SYCL_EXT_INTEL_DEVICE_INFO
+    if (sycl_device.has(sycl::aspect::ext_intel_pci_address))
+      return pci_address::parse(sycl_device.get_info<sycl::ext::intel::info::device::pci_address>());
+#endif
+    return std::nullopt;
+  }
 
   // TODO: handle the case where different platform may expose the same device (very-low priority, since there is no way to do it properly in SYCL)
-  // TODO: make sure that index given to synergy::device constructor is the "same" of the sycl::device
+  // TODO: make sure that index given to synergy::device constructor is the "same" of the sycl::device when the PCI address is not reported (AdaptiveCpp)
+  // only the SYCL devices are enumerated here, no vendor library is touched until a device is used
   runtime() {
     using namespace sycl;
 
@@ -41,6 +192,14 @@ private:
 
 #ifdef SYNERGY_ROCM_SUPPORT
     int count_hip = 0;
+#endif
+#if defined(SYNERGY_SIM_SUPPORT)
+    using host_vendor = management::sim; // takes the place of the real CPU backend
+#elif defined(SYNERGY_CPU_SUPPORT)
+    using host_vendor = management::cpu;
+#endif
+#if defined(SYNERGY_CPU_SUPPORT) || defined(SYNERGY_SIM_SUPPORT)
+    std::optional<sycl::device> host_cpu; // the first CPU device, every platform exposing the host CPU shares its entry
 #endif
     for (size_t i = 0; i < platforms.size(); i++) {
 
@@ -56,8 +215,8 @@ private:
         auto devs = platforms[i].get_devices(info::device_type::gpu);
 
         for (size_t j = 0; j < devs.size(); j++) {
-          auto ptr = std::make_shared<vendor_device<management::nvml>>(j);
-          devices.insert({devs[j], synergy::device{ptr}});
+          auto address = pci_address_of(devs[j]);
+          register_device(devs[j], [j, address] { return std::make_shared<vendor_device<management::nvml>>(j, address); }, address);
         }
       }
 #endif
@@ -67,9 +226,20 @@ private:
         auto devs = platforms[i].get_devices(info::device_type::gpu);
 
         for (size_t j = 0; j < devs.size(); j++) {
-          auto ptr = std::make_shared<vendor_device<management::rsmi>>(count_hip); // passing count_hip is not an error: compile with SYNERGY_PROOF
-          count_hip++;                                                             // there is one platform for each AMD HIP GPU
-          devices.insert({devs[j], synergy::device{ptr}});
+          auto address = pci_address_of(devs[j]);
+          register_device(devs[j], [count_hip, address] { return std::make_shared<vendor_device<management::rsmi>>(count_hip, address); }, address); // passing count_hip is not an error: compile with SYNERGY_PROOF
+          count_hip++;                                                                                                                          // there is one platform for each AMD HIP GPU
+        }
+      }
+#endif
+
+#if defined(SYNERGY_CPU_SUPPORT) || defined(SYNERGY_SIM_SUPPORT)
+      for (const auto& dev : platforms[i].get_devices(info::device_type::cpu)) {
+        if (host_cpu) {
+          devices.insert({dev, devices.at(*host_cpu)});
+        } else {
+          register_device(dev, [] { return std::make_shared<vendor_device<host_vendor>>(0); });
+          host_cpu = dev;
         }
       }
 #endif
@@ -79,8 +249,8 @@ private:
           platform_name.find("level zero") != std::string::npos) {
         auto devs = platforms[i].get_devices(info::device_type::gpu);
         for (size_t j = 0; j < devs.size(); j++) {
-          auto ptr = std::make_shared<vendor_device<management::lz>>(j);
-          devices.insert({devs[j], synergy::device{ptr}});
+          auto address = pci_address_of(devs[j]);
+          register_device(devs[j], [j, address] { return std::make_shared<vendor_device<management::lz>>(j, address); }, address);
         }
       }
 #endif
@@ -89,4 +259,9 @@ private:
 };
 } // namespace detail
 
+// sets up the vendor libraries and every supported device in parallel, otherwise each device is set up by its first queue
+inline void preload_devices() {
+  detail::runtime::preload_devices();
+}
+
 } // namespace synergy
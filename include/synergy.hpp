@@ -2,6 +2,8 @@
 
 #include <sycl/sycl.hpp>
 
+#include "frequency_scope.hpp"
 #include "queue.hpp"
+#include "region.hpp"
 #include "types.hpp"
 #include "profiling/sycl_profiler.hpp"
\ No newline at end of file
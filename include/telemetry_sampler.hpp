@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "device.hpp"
+#include "periodic_timer.hpp"
+#include "power_trace.hpp"
+#include "profilers.hpp"
+#include "topology.hpp"
+
+namespace synergy {
+
+namespace detail {
+
+struct energy_snapshot {
+  double device = 0.0;       // joules consumed by the device since its trace started
+  double host = 0.0;         // joules consumed by the host since the sampler started
+  double process_host = 0.0; // part of host attributed to this process, with SYNERGY_HOST_PROCESS_ATTRIBUTION
+};
+
+/**
+ * Samples the power of one physical device into its power trace, and the energy of the host with
+ * SYNERGY_HOST_PROFILING, on a single thread shared by all the queues of the device. Queues take a
+ * snapshot when they are created and report the difference with the current one. The thread runs
+ * on the CPUs local to the device, when they are known.
+ */
+class telemetry_sampler {
+public:
+  using clock = std::chrono::steady_clock;
+
+  friend class device_profiler<telemetry_sampler>;
+  friend class host_device_profiler<telemetry_sampler>;
+
+  telemetry_sampler(synergy::device device, const device_topology& topology = {})
+      : device{device}, timer{std::chrono::milliseconds{this->device.get_power_sampling_rate()}} {
+    this->device.trace->allocate();
+
+    // a previous sampler of the same device may have left records in the trace
+    auto last = this->device.trace->latest();
+    energy_offset = last ? last->energy : 0.0;
+
+#ifdef SYNERGY_HOST_PROFILING
+    profiler = std::thread{detail::host_device_profiler<telemetry_sampler>{*this}};
+#else
+    profiler = std::thread{detail::device_profiler<telemetry_sampler>{*this}};
+#endif
+    pin_thread(profiler.native_handle(), topology.local_cpus);
+  }
+
+  telemetry_sampler(const telemetry_sampler&) = delete;
+  telemetry_sampler& operator=(const telemetry_sampler&) = delete;
+
+  ~telemetry_sampler() {
+    finished.store(true, std::memory_order_release);
+    profiler.join();
+  }
+
+  energy_snapshot snapshot() const {
+    auto last = device.trace->latest();
+    return energy_snapshot{
+        last ? last->energy : 0.0,
+        host_energy_consumption.load(std::memory_order_acquire),
+        process_host_energy_consumption.load(std::memory_order_acquire)};
+  }
+
+  // time of the latest record, the trace covers nothing after it
+  clock::time_point covered_until() const {
+    auto last = device.trace->latest();
+    return last ? last->time : clock::time_point::min();
+  }
+
+  std::vector<power_record> records_between(clock::time_point t0, clock::time_point t1) const {
+    return device.trace->records_between(t0, t1);
+  }
+
+  // sampling periods skipped because reading the sensors took longer than the sampling rate
+  std::uint64_t missed_deadlines() const {
+    return timer.missed_deadlines();
+  }
+
+private:
+  synergy::device device;
+  double energy_offset = 0.0;
+  std::atomic<double> host_energy_consumption = 0.0;
+  std::atomic<double> process_host_energy_consumption = 0.0;
+  std::atomic<bool> finished = false;
+  periodic_timer timer;
+  std::thread profiler;
+
+  void record(clock::time_point time, power sample, double energy) {
+    device.trace->push(power_record{time, sample, energy_offset + energy});
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace synergy {
+
+namespace detail {
+
+// domain:bus:device.function of a PCI device, the identity vendor libraries and SYCL agree on
+struct pci_address {
+  unsigned domain = 0;
+  unsigned bus = 0;
+  unsigned device = 0;
+  unsigned function = 0;
+
+  // accepts "dddd:bb:dd.f", with any number of domain digits, and "bb:dd.f"
+  static std::optional<pci_address> parse(const std::string& text) {
+    pci_address a;
+    char trailing;
+    if (std::sscanf(text.c_str(), "%x:%x:%x.%x%c", &a.domain, &a.bus, &a.device, &a.function, &trailing) == 4)
+      return a;
+
+    a.domain = 0;
+    if (std::sscanf(text.c_str(), "%x:%x.%x%c", &a.bus, &a.device, &a.function, &trailing) == 3)
+      return a;
+
+    return std::nullopt;
+  }
+
+  // the sysfs spelling, e.g. "0000:3b:00.0"
+  std::string to_string() const {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%04x:%02x:%02x.%x", domain, bus, device, function);
+    return text;
+  }
+
+  bool operator==(const pci_address& other) const {
+    return domain == other.domain && bus == other.bus && device == other.device && function == other.function;
+  }
+};
+
+/**
+ * NUMA node of a device and the CPUs local to it, as reported by the PCI bus. Both are unknown
+ * (-1 and empty) for devices without a PCI address or on kernels without NUMA support.
+ */
+struct device_topology {
+  int numa_node = -1;
+  std::vector<unsigned> local_cpus;
+
+  // parses a cpulist such as "0-15,32-47"
+  static std::vector<unsigned> parse_cpu_list(const std::string& list) {
+    std::vector<unsigned> cpus;
+    std::stringstream ranges{list};
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+      unsigned first, last;
+      int fields = std::sscanf(range.c_str(), "%u-%u", &first, &last);
+      if (fields < 1)
+        continue;
+      if (fields == 1)
+        last = first;
+      for (unsigned cpu = first; cpu <= last; cpu++)
+        cpus.push_back(cpu);
+    }
+    return cpus;
+  }
+
+  static device_topology of(const pci_address& address, const std::string& sys_root = "/sys") {
+    device_topology topology;
+    std::string path = sys_root + "/bus/pci/devices/" + address.to_string();
+
+    std::ifstream node{path + "/numa_node"};
+    if (!(node >> topology.numa_node))
+      topology.numa_node = -1;
+
+    std::ifstream cpus{path + "/local_cpulist"};
+    std::string list;
+    if (std::getline(cpus, list))
+      topology.local_cpus = parse_cpu_list(list);
+
+    return topology;
+  }
+};
+
+// restricts a thread to the given CPUs; an empty list, or a failure, leaves it free to run anywhere
+inline bool pin_thread(pthread_t thread, const std::vector<unsigned>& cpus) {
+  if (cpus.empty())
+    return false;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (unsigned cpu : cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+} // namespace detail
+
+} // namespace synergy
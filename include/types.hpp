@@ -1,8 +1,40 @@
 #pragma once
 
+#include <chrono>
+#include <optional>
+
+#if defined(SYNERGY_DEVICE_PROFILING) || defined(SYNERGY_KERNEL_PROFILING)
+#define SYNERGY_ENABLE_PROFILING
+#endif
+
 namespace synergy {
 using frequency = unsigned;
 using power = unsigned long long;
 using energy = double;
 
+/**
+ * Telemetry of a device at one instant, read with as few vendor calls as possible. Metrics the
+ * device or its vendor library does not report are left empty.
+ */
+struct device_sample {
+  // reasons for the clocks to be below the requested ones, combined in throttle_reasons
+  enum throttle : unsigned {
+    idle = 1 << 0,           // nothing is running
+    clock_setting = 1 << 1,  // capped by the application or the user
+    power_cap = 1 << 2,      // average or peak power limit
+    thermal = 1 << 3,        // temperature limit
+    hardware = 1 << 4,       // hardware slowdown, e.g. an external power brake
+    other = 1 << 5
+  };
+
+  std::chrono::steady_clock::time_point time;
+  std::optional<power> power_usage;          // microwatts
+  std::optional<energy> energy_usage;        // microjoules, from the same counter as get_energy_usage
+  std::optional<frequency> core_frequency;   // current clock, not the requested one
+  std::optional<frequency> uncore_frequency; // current clock, not the requested one
+  std::optional<double> temperature;         // degrees Celsius
+  std::optional<unsigned> utilization;       // percentage of time the device was busy
+  std::optional<unsigned> throttle_reasons;  // bitmask of throttle values
+};
+
 } // namespace synergy
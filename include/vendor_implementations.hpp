@@ -10,4 +10,12 @@
 
 #ifdef SYNERGY_LZ_SUPPORT
 #include "vendors/lz_wrapper.hpp"
-#endif
\ No newline at end of file
+#endif
+
+#ifdef SYNERGY_CPU_SUPPORT
+#include "vendors/cpu_wrapper.hpp"
+#endif
+
+#ifdef SYNERGY_SIM_SUPPORT
+#include "vendors/sim_wrapper.hpp"
+#endif
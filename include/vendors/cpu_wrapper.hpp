@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../host_profiler.hpp"
+#include "../management_wrapper.hpp"
+
+namespace synergy {
+
+namespace detail {
+
+namespace management {
+struct cpu {
+  static constexpr std::string_view name = "CPU";
+  static constexpr unsigned int sampling_rate = 5; // ms
+  static constexpr bool paired_clocks = false;
+  static constexpr unsigned int frequency_step = 100; // MHz, for drivers without a frequency table
+  using device_identifier = unsigned int;
+  using device_handle = unsigned int; // a SYCL CPU device spans every package of the host
+  using return_type = int;
+  static constexpr int return_success = 0;
+};
+
+} // namespace management
+
+/**
+ * Energy from the RAPL package zones and core frequency scaling through cpufreq, applied to every
+ * CPU of the host. The frequency is written to scaling_setspeed with the userspace governor and
+ * otherwise pinned with scaling_min_freq and scaling_max_freq; the original settings are restored
+ * by reset_frequencies and when the wrapper is destroyed. The uncore clock is not managed. Without
+ * access to the energy files, e.g. as a non-root user, the device has no energy counter.
+ */
+template <>
+class management_wrapper<management::cpu> {
+
+public:
+  // sys_root is the mount point of sysfs, e.g. a fake tree for testing
+  explicit management_wrapper(const std::string& sys_root = SYNERGY_SYSFS_ROOT) {
+    try {
+      rapl = std::make_unique<host_profiler::rapl_reader>(sys_root + "/class/powercap");
+      start = {std::chrono::steady_clock::now(), rapl->energy(host_profiler::rapl_domain::package)};
+    } catch (const std::exception&) {
+      rapl.reset(); // energy_uj is only readable by root on recent kernels
+    }
+
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(sys_root + "/devices/system/cpu", error)) {
+      std::string name = entry.path().filename().string();
+      if (name.size() > 3 && name.compare(0, 3, "cpu") == 0 && name.find_first_not_of("0123456789", 3) == std::string::npos &&
+          std::filesystem::exists(entry.path() / "cpufreq"))
+        policies.push_back(entry.path() / "cpufreq");
+    }
+    std::sort(policies.begin(), policies.end());
+
+    for (const auto& policy : policies)
+      original.push_back({read(policy / "scaling_min_freq", false), read(policy / "scaling_max_freq", false),
+                          read(policy / "scaling_governor", false) == "userspace" ? read(policy / "scaling_setspeed", false) : ""});
+  }
+
+  management_wrapper(const management_wrapper&) = delete;
+  management_wrapper& operator=(const management_wrapper&) = delete;
+
+  ~management_wrapper() {
+    if (scaled)
+      restore_limits();
+  }
+
+  inline unsigned int get_devices_count() const { return 1; }
+
+  // the sysfs files are discovered by the constructor, every wrapper has its own readers
+  inline void initialize() const {}
+
+  inline void shutdown() const {}
+
+  using cpu = management::cpu;
+
+  inline cpu::device_handle get_device_handle(cpu::device_identifier id) const { return id; }
+
+  // the host CPU is not a PCI device
+  inline cpu::device_handle get_device_handle(const pci_address&) const {
+    throw std::runtime_error{"synergy " + std::string(cpu::name) + " wrapper error: devices cannot be looked up by PCI address"};
+  }
+
+  // average power since the previous call from the same thread, so that concurrent samplers do not shorten each other's intervals
+  inline power get_power_usage(cpu::device_handle) const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return average_power(read_energy());
+  }
+
+  inline energy get_energy_usage(cpu::device_handle) const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return static_cast<energy>(read_energy().energy); // microjoules
+  }
+
+  // the energy and the clock of the host; temperature and utilization are not read
+  inline device_sample sample(cpu::device_handle handle) const {
+    device_sample s;
+    if (rapl) {
+      std::lock_guard<std::mutex> lock{mutex};
+      reading current = read_energy();
+      s.time = current.time;
+      s.power_usage = average_power(current);
+      s.energy_usage = static_cast<energy>(current.energy);
+    } else {
+      s.time = std::chrono::steady_clock::now();
+    }
+    if (!policies.empty())
+      s.core_frequency = get_core_frequency(handle);
+    return s;
+  }
+
+  inline std::vector<frequency> get_supported_core_frequencies(cpu::device_handle) const {
+    if (policies.empty())
+      return {};
+
+    std::vector<frequency> frequencies;
+    std::istringstream available{read(policies.front() / "scaling_available_frequencies", false)};
+    for (unsigned long khz; available >> khz;)
+      frequencies.push_back(static_cast<frequency>(khz / 1000));
+
+    // drivers like intel_pstate have no table: any value between the hardware limits is accepted
+    if (frequencies.empty()) {
+      frequency min = to_mhz(read(policies.front() / "cpuinfo_min_freq"));
+      frequency max = to_mhz(read(policies.front() / "cpuinfo_max_freq"));
+      for (frequency f = min; f < max; f += cpu::frequency_step)
+        frequencies.push_back(f);
+      frequencies.push_back(max);
+    }
+
+    std::sort(frequencies.begin(), frequencies.end());
+    frequencies.erase(std::unique(frequencies.begin(), frequencies.end()), frequencies.end());
+    return frequencies;
+  }
+
+  inline std::vector<frequency> get_supported_uncore_frequencies(cpu::device_handle) const { return {}; }
+
+  inline frequency get_core_frequency(cpu::device_handle) const {
+    if (policies.empty())
+      return 0;
+    return to_mhz(read(policies.front() / "scaling_cur_freq"));
+  }
+
+  inline frequency get_uncore_frequency(cpu::device_handle) const { return 0; }
+
+  inline void set_core_frequency(cpu::device_handle, frequency target) const {
+    if (policies.empty())
+      throw std::runtime_error{"synergy " + std::string(cpu::name) + " wrapper error: cpufreq is not available"};
+
+    std::string khz = std::to_string(static_cast<unsigned long>(target) * 1000);
+    scaled = true;
+    for (const auto& policy : policies) {
+      if (read(policy / "scaling_governor", false) == "userspace") {
+        write(policy / "scaling_setspeed", khz);
+        continue;
+      }
+
+      // the range must stay valid after every write
+      if (target * 1000UL > std::stoul(read(policy / "scaling_max_freq"))) {
+        write(policy / "scaling_max_freq", khz);
+        write(policy / "scaling_min_freq", khz);
+      } else {
+        write(policy / "scaling_min_freq", khz);
+        write(policy / "scaling_max_freq", khz);
+      }
+    }
+  }
+
+  inline void set_uncore_frequency(cpu::device_handle, frequency) const {
+    throw std::runtime_error{"synergy " + std::string(cpu::name) + " wrapper error: set_uncore_frequency is not supported"};
+  }
+
+  inline void set_all_frequencies(cpu::device_handle handle, frequency core, frequency uncore) const {
+    if (uncore != 0)
+      set_uncore_frequency(handle, uncore);
+    set_core_frequency(handle, core);
+  }
+
+  inline void reset_frequencies(cpu::device_handle) const {
+    if (!restore_limits())
+      throw std::runtime_error{"synergy " + std::string(cpu::name) + " wrapper error: could not restore the cpufreq limits"};
+    scaled = false;
+  }
+
+  inline void setup_profiling(cpu::device_handle) const {}
+
+  inline void setup_scaling(cpu::device_handle) const {}
+
+  inline std::string error_string(cpu::return_type return_value) const { return std::strerror(return_value); }
+
+private:
+  struct reading {
+    std::chrono::steady_clock::time_point time;
+    double energy; // microjoules
+  };
+
+  struct limits {
+    std::string min;
+    std::string max;
+    std::string setspeed; // only with the userspace governor
+  };
+
+  mutable std::mutex mutex;
+  std::unique_ptr<host_profiler::rapl_reader> rapl; // null without access to the energy files
+  reading start;
+  mutable std::unordered_map<std::thread::id, reading> previous; // the last reading of every thread
+  std::vector<std::filesystem::path> policies; // the cpufreq directory of every CPU
+  std::vector<limits> original;                // the settings of every policy before any scaling
+  mutable bool scaled = false;
+
+  // best effort: the limits may have been changed by someone else in the meantime
+  bool restore_limits() const {
+    bool restored = true;
+    for (std::size_t i = 0; i < policies.size(); i++) {
+      const auto& [min, max, setspeed] = original[i];
+      if (!setspeed.empty())
+        restored &= write(policies[i] / "scaling_setspeed", setspeed, std::nothrow);
+      // the range must stay valid: raise the maximum, set the minimum, then lower the maximum
+      if (!max.empty() && !min.empty()) {
+        write(policies[i] / "scaling_max_freq", max, std::nothrow);
+        restored &= write(policies[i] / "scaling_min_freq", min, std::nothrow);
+        restored &= write(policies[i] / "scaling_max_freq", max, std::nothrow);
+      }
+    }
+    return restored;
+  }
+
+  // with the mutex held
+  reading read_energy() const {
+    if (!rapl)
+      throw std::runtime_error{"synergy " + std::string(cpu::name) + " wrapper error: no energy counter, the RAPL energy files are not readable"};
+    return {std::chrono::steady_clock::now(), rapl->energy(host_profiler::rapl_domain::package)};
+  }
+
+  // with the mutex held; the first call of a thread averages since the wrapper was created
+  power average_power(const reading& current) const {
+    auto it = previous.try_emplace(std::this_thread::get_id(), start).first;
+    double seconds = std::chrono::duration<double>(current.time - it->second.time).count();
+    power average = seconds > 0 ? static_cast<power>((current.energy - it->second.energy) / seconds) : 0; // microwatts
+    it->second = current;
+    return average;
+  }
+
+  static frequency to_mhz(const std::string& khz) {
+    return static_cast<frequency>(std::stoul(khz) / 1000);
+  }
+
+  static std::string read(const std::filesystem::path& path, bool required = true) {
+    std::ifstream file{path};
+    std::string value;
+    if (!std::getline(file, value) && required)
+      throw std::runtime_error{"synergy " + std::string(management::cpu::name) + " wrapper error: could not read " + path.string()};
+    return value;
+  }
+
+  static void write(const std::filesystem::path& path, const std::string& value) {
+    if (!write(path, value, std::nothrow))
+      throw std::runtime_error{"synergy " + std::string(management::cpu::name) + " wrapper error: could not write " + path.string()};
+  }
+
+  static bool write(const std::filesystem::path& path, const std::string& value, const std::nothrow_t&) {
+    std::ofstream file{path};
+    return static_cast<bool>(file << value << std::flush);
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
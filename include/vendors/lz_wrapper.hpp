@@ -1,6 +1,11 @@
 #pragma once
 
 #include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <vector>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -9,6 +14,9 @@
 #include <level_zero/zes_api.h>
 
 #include "../management_wrapper.hpp"
+#ifdef SYNERGY_DYNAMIC_VENDORS
+#include "../dynamic_library.hpp"
+#endif
 
 namespace synergy {
 namespace detail {
@@ -17,6 +25,7 @@ struct lz {
   static constexpr std::string_view name = "LZ";
   static constexpr unsigned int max_frequencies = 256;
   static constexpr unsigned int sampling_rate = 5; // ms
+  static constexpr bool paired_clocks = false;
   using device_identifier = unsigned int;
   using device_handle = zes_device_handle_t;
   using return_type = ze_result_t;
@@ -24,6 +33,31 @@ struct lz {
 };
 }; // namespace management
 
+#define SYNERGY_LZ_FUNCTIONS(X)      \
+  X(zeInit)                          \
+  X(zeDriverGet)                     \
+  X(zeDeviceGet)                     \
+  X(zesDevicePciGetProperties)       \
+  X(zesDeviceEnumFrequencyDomains)   \
+  X(zesDeviceGetCardPowerDomain)     \
+  X(zesFrequencyGetProperties)       \
+  X(zesFrequencyGetAvailableClocks)  \
+  X(zesFrequencyGetState)            \
+  X(zesFrequencySetRange)            \
+  X(zesPowerGetEnergyCounter)        \
+  X(zesDeviceEnumTemperatureSensors) \
+  X(zesTemperatureGetProperties)     \
+  X(zesTemperatureGetState)
+
+#ifdef SYNERGY_DYNAMIC_VENDORS
+SYNERGY_LZ_FUNCTIONS(SYNERGY_DECLARE_VENDOR_FUNCTION)
+
+inline void load_lz() {
+  static dynamic_library lz_library{management::lz::name, {"libze_loader.so.1", "libze_loader.so"}};
+  lz_library.load([](const dynamic_library& library) { SYNERGY_LZ_FUNCTIONS(SYNERGY_RESOLVE_VENDOR_FUNCTION) });
+}
+#endif
+
 template <>
 class management_wrapper<management::lz> {
 
@@ -33,6 +67,9 @@ public:
   }
 
   inline void initialize() const {
+#ifdef SYNERGY_DYNAMIC_VENDORS
+    load_lz();
+#endif
     check(zeInit(0));
   }
 
@@ -40,52 +77,96 @@ public:
 
   using lz = management::lz;
 
+  // the Sysman handles of the device are resolved here, once
   inline lz::device_handle get_device_handle(lz::device_identifier id) const {
-    auto ret = (lz::device_handle)get_devices()[id];
+    auto ret = (lz::device_handle)get_devices().at(id);
+    resolve(ret);
     return ret;
   }
 
+  inline lz::device_handle get_device_handle(const pci_address& address) const {
+    for (auto device : get_devices()) {
+      auto handle = (lz::device_handle)device;
+      zes_pci_properties_t props{};
+      props.stype = ZES_STRUCTURE_TYPE_PCI_PROPERTIES;
+      check(zesDevicePciGetProperties(handle, &props));
+      pci_address candidate{props.address.domain, props.address.bus, props.address.device, props.address.function};
+      if (candidate == address) {
+        resolve(handle);
+        return handle;
+      }
+    }
+    throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: no device at PCI address " + address.to_string()};
+  }
+
   inline power get_power_usage(lz::device_handle handle) const {
     throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: get_power_usage is not supported"};
   }
 
   inline energy get_energy_usage(lz::device_handle handle) const {
-    zes_pwr_handle_t hPwr;
-    check(zesDeviceGetCardPowerDomain(handle, &hPwr));
+    zes_pwr_handle_t power_domain = handles_of(handle).power;
+    if (power_domain == nullptr)
+      throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: the device has no card power domain"};
 
     zes_power_energy_counter_t counter;
-    check(zesPowerGetEnergyCounter(hPwr, &counter));
+    check(zesPowerGetEnergyCounter(power_domain, &counter));
     return counter.energy;
   }
 
+  // the frequency states carry both the clocks and the throttle reasons; power and utilization are left
+  // empty, Sysman only reports them as counters that need two readings
+  inline device_sample sample(lz::device_handle handle) const {
+    device_sample s;
+    s.time = std::chrono::steady_clock::now();
+    const sysman_handles& domains = handles_of(handle);
+
+    zes_power_energy_counter_t counter;
+    if (domains.power != nullptr && zesPowerGetEnergyCounter(domains.power, &counter) == lz::return_success)
+      s.energy_usage = counter.energy;
+
+    auto read_state = [&s](zes_freq_handle_t h_freq, std::optional<frequency>& target) {
+      zes_freq_state_t state{};
+      state.stype = ZES_STRUCTURE_TYPE_FREQ_STATE;
+      if (h_freq == nullptr || zesFrequencyGetState(h_freq, &state) != lz::return_success)
+        return;
+
+      if (state.actual >= 0)
+        target = static_cast<frequency>(state.actual);
+      s.throttle_reasons = s.throttle_reasons.value_or(0) | throttle_mask(state.throttleReasons);
+    };
+    read_state(domains.core, s.core_frequency);
+    read_state(domains.uncore, s.uncore_frequency);
+
+    double temperature;
+    if (domains.temperature != nullptr && zesTemperatureGetState(domains.temperature, &temperature) == lz::return_success)
+      s.temperature = temperature;
+
+    return s;
+  }
+
   inline std::vector<frequency> get_supported_core_frequencies(const lz::device_handle handle) const {
-    return get_supported_frequency<ZES_FREQ_DOMAIN_GPU>(handle);
+    return get_supported_frequency(handles_of(handle).core);
   }
 
   inline std::vector<frequency> get_supported_uncore_frequencies(const lz::device_handle handle) const {
-    return get_supported_frequency<ZES_FREQ_DOMAIN_MEMORY>(handle);
+    return get_supported_frequency(handles_of(handle).uncore);
   }
 
   inline frequency get_core_frequency(const lz::device_handle handle) const {
-    return get_frequency<ZES_FREQ_DOMAIN_GPU>(handle);
+    return get_frequency(handles_of(handle).core);
   }
 
   inline frequency get_uncore_frequency(const lz::device_handle handle) const {
-    return get_frequency<ZES_FREQ_DOMAIN_MEMORY>(handle);
+    return get_frequency(handles_of(handle).uncore);
   }
 
   inline void set_core_frequency(const lz::device_handle handle, frequency target) const {
-    auto h_freq = get_frequency_handle<ZES_FREQ_DOMAIN_GPU>(handle);
-    double freq = static_cast<double>(target);
-    zes_freq_range_t range{freq, freq};
-    check(zesFrequencySetRange(h_freq, &range));
+    set_frequency(handles_of(handle).core, target, "core");
   }
 
+  // integrated GPUs have no memory frequency domain
   inline void set_uncore_frequency(const lz::device_handle handle, frequency target) const {
-    auto h_freq = get_frequency_handle<ZES_FREQ_DOMAIN_MEMORY>(handle);
-    double freq = static_cast<double>(target);
-    zes_freq_range_t range{freq, freq};
-    check(zesFrequencySetRange(h_freq, &range));
+    set_frequency(handles_of(handle).uncore, target, "uncore");
   }
 
   inline void set_all_frequencies(lz::device_handle handle, frequency core, frequency uncore) const {
@@ -93,6 +174,12 @@ public:
     set_uncore_frequency(handle, uncore);
   }
 
+  inline void reset_frequencies(lz::device_handle handle) const {
+    const sysman_handles& domains = handles_of(handle);
+    reset_frequency(domains.core);
+    reset_frequency(domains.uncore);
+  }
+
   inline void setup_profiling(lz::device_handle) const {}
 
   inline void setup_scaling(lz::device_handle) const {}
@@ -193,60 +280,113 @@ public:
 private:
   error_checker<management::lz> check{*this};
 
-  inline std::vector<ze_device_handle_t> get_devices() const {
-    unsigned int drivers_count = 0;
-    check(zeDriverGet(&drivers_count, nullptr));
-
-    if (drivers_count < 1) {
-      throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: could not get Level Zero drivers"};
-    }
-    std::vector<ze_driver_handle_t> drivers(drivers_count);
-    check(zeDriverGet(&drivers_count, drivers.data()));
+  static unsigned throttle_mask(zes_freq_throttle_reason_flags_t reasons) {
+    unsigned mask = 0;
+    if (reasons & (ZES_FREQ_THROTTLE_REASON_FLAG_AVE_PWR_CAP | ZES_FREQ_THROTTLE_REASON_FLAG_BURST_PWR_CAP | ZES_FREQ_THROTTLE_REASON_FLAG_CURRENT_LIMIT))
+      mask |= device_sample::power_cap;
+    if (reasons & ZES_FREQ_THROTTLE_REASON_FLAG_THERMAL_LIMIT)
+      mask |= device_sample::thermal;
+    if (reasons & ZES_FREQ_THROTTLE_REASON_FLAG_SW_RANGE)
+      mask |= device_sample::clock_setting;
+    if (reasons & (ZES_FREQ_THROTTLE_REASON_FLAG_PSU_ALERT | ZES_FREQ_THROTTLE_REASON_FLAG_HW_RANGE))
+      mask |= device_sample::hardware;
+    return mask;
+  }
 
-    unsigned int total_devices_count = 0;
-    unsigned int devices_per_driver = 0;
+  // Sysman handles of a device, resolved once by get_device_handle; null when the device lacks the domain
+  struct sysman_handles {
+    zes_freq_handle_t core = nullptr;
+    zes_freq_handle_t uncore = nullptr;
+    zes_pwr_handle_t power = nullptr;
+    zes_temp_handle_t temperature = nullptr;
+  };
+
+  mutable std::vector<ze_device_handle_t> devices;
+  mutable std::once_flag enumerated;
+
+  // entries are never erased, so references to them stay valid without holding the mutex
+  mutable std::mutex resolved_mutex;
+  mutable std::map<lz::device_handle, sysman_handles> resolved;
+
+  // the drivers and their devices are enumerated on the first call only
+  inline const std::vector<ze_device_handle_t>& get_devices() const {
+    std::call_once(enumerated, [this] {
+      unsigned int drivers_count = 0;
+      check(zeDriverGet(&drivers_count, nullptr));
+
+      if (drivers_count < 1) {
+        throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: could not get Level Zero drivers"};
+      }
+      std::vector<ze_driver_handle_t> drivers(drivers_count);
+      check(zeDriverGet(&drivers_count, drivers.data()));
 
-    for (unsigned i = 0; i < drivers.size(); i++) {
-      check(zeDeviceGet(drivers[i], &devices_per_driver, nullptr));
-      total_devices_count += devices_per_driver;
-    }
+      for (auto driver : drivers) {
+        unsigned int devices_per_driver = 0;
+        check(zeDeviceGet(driver, &devices_per_driver, nullptr));
 
-    std::vector<ze_device_handle_t> devices(total_devices_count);
-    for (unsigned i = 0, offset = 0; i < drivers.size(); i++) {
-      check(zeDeviceGet(drivers[i], &devices_per_driver, &devices.data()[offset]));
-      offset += devices_per_driver;
-    }
+        std::vector<ze_device_handle_t> driver_devices(devices_per_driver);
+        check(zeDeviceGet(driver, &devices_per_driver, driver_devices.data()));
+        devices.insert(devices.end(), driver_devices.begin(), driver_devices.end());
+      }
+    });
 
     return devices;
   }
 
-  template <zes_freq_domain_t domain>
-  zes_freq_handle_t get_frequency_handle(const management::lz::device_handle handle) const {
-    zes_freq_handle_t ret = nullptr;
+  inline void resolve(lz::device_handle handle) const {
+    std::lock_guard<std::mutex> lock{resolved_mutex};
+    if (resolved.count(handle))
+      return;
+
+    sysman_handles domains;
+
     unsigned handles_count = 0;
     check(zesDeviceEnumFrequencyDomains(handle, &handles_count, nullptr));
+    std::vector<zes_freq_handle_t> frequency_domains(handles_count);
+    check(zesDeviceEnumFrequencyDomains(handle, &handles_count, frequency_domains.data()));
+    for (auto h_freq : frequency_domains) {
+      zes_freq_properties_t props{};
+      props.stype = ZES_STRUCTURE_TYPE_FREQ_PROPERTIES;
+      if (zesFrequencyGetProperties(h_freq, &props) != lz::return_success)
+        continue;
+
+      if (props.type == ZES_FREQ_DOMAIN_GPU && domains.core == nullptr)
+        domains.core = h_freq;
+      else if (props.type == ZES_FREQ_DOMAIN_MEMORY && domains.uncore == nullptr)
+        domains.uncore = h_freq;
+    }
 
-    if (handles_count > 0) {
-      std::vector<zes_freq_handle_t> handles(handles_count);
-      check(zesDeviceEnumFrequencyDomains(handle, &handles_count, handles.data()));
-      for (unsigned i = 0; i < handles_count; i++) {
-        zes_freq_properties_t props{};
-        props.stype = ZES_STRUCTURE_TYPE_FREQ_PROPERTIES;
-        if (zesFrequencyGetProperties(handles[i], &props) == lz::return_success) {
-          if (props.type == domain) {
-            ret = handles[i];
+    if (zesDeviceGetCardPowerDomain(handle, &domains.power) != lz::return_success)
+      domains.power = nullptr;
+
+    unsigned sensors_count = 0;
+    if (zesDeviceEnumTemperatureSensors(handle, &sensors_count, nullptr) == lz::return_success && sensors_count > 0) {
+      std::vector<zes_temp_handle_t> sensors(sensors_count);
+      if (zesDeviceEnumTemperatureSensors(handle, &sensors_count, sensors.data()) == lz::return_success) {
+        for (auto sensor : sensors) {
+          zes_temp_properties_t props{};
+          props.stype = ZES_STRUCTURE_TYPE_TEMP_PROPERTIES;
+          if (zesTemperatureGetProperties(sensor, &props) == lz::return_success && props.type == ZES_TEMP_SENSORS_GPU) {
+            domains.temperature = sensor;
             break;
           }
         }
       }
     }
-    return ret;
+
+    resolved.emplace(handle, domains);
   }
 
-  template <zes_freq_domain_t domain>
-  std::vector<frequency> get_supported_frequency(const lz::device_handle handle) const {
+  inline const sysman_handles& handles_of(lz::device_handle handle) const {
+    std::lock_guard<std::mutex> lock{resolved_mutex};
+    auto search = resolved.find(handle);
+    if (search == resolved.end())
+      throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: device handle was not obtained from get_device_handle"};
+    return search->second;
+  }
+
+  std::vector<frequency> get_supported_frequency(zes_freq_handle_t h_freq) const {
     std::vector<frequency> freqs;
-    zes_freq_handle_t h_freq = get_frequency_handle<domain>(handle);
     if (h_freq != nullptr) {
       unsigned count = 0;
       check(zesFrequencyGetAvailableClocks(h_freq, &count, nullptr));
@@ -261,15 +401,38 @@ private:
     return freqs;
   }
 
-  template <zes_freq_domain_t domain>
-  inline frequency get_frequency(const lz::device_handle handle) const {
-    auto h_freq = get_frequency_handle<ZES_FREQ_DOMAIN_GPU>(handle);
+  // 0 when the device lacks the domain, like the empty table of get_supported_frequency
+  inline frequency get_frequency(zes_freq_handle_t h_freq) const {
+    if (h_freq == nullptr)
+      return 0;
+
     zes_freq_state_t state{};
     state.stype = ZES_STRUCTURE_TYPE_FREQ_STATE;
 
     check(zesFrequencyGetState(h_freq, &state));
     return state.actual;
   }
+
+  inline void set_frequency(zes_freq_handle_t h_freq, frequency target, const char* domain) const {
+    if (h_freq == nullptr)
+      throw std::runtime_error{"synergy " + std::string(lz::name) + " wrapper error: " + domain + " frequency scaling is not supported by the device"};
+
+    double freq = static_cast<double>(target);
+    zes_freq_range_t range{freq, freq};
+    check(zesFrequencySetRange(h_freq, &range));
+  }
+
+  // widens the range back to the hardware limits
+  inline void reset_frequency(zes_freq_handle_t h_freq) const {
+    if (h_freq == nullptr)
+      return;
+
+    zes_freq_properties_t props{};
+    props.stype = ZES_STRUCTURE_TYPE_FREQ_PROPERTIES;
+    check(zesFrequencyGetProperties(h_freq, &props));
+    zes_freq_range_t range{props.min, props.max};
+    check(zesFrequencySetRange(h_freq, &range));
+  }
 };
 
 }; // namespace detail
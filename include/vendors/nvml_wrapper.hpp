@@ -1,12 +1,16 @@
 #pragma once
 
 #include <array>
+#include <chrono>
 #include <stdexcept>
 #include <string_view>
 
 #include <nvml.h>
 
 #include "../management_wrapper.hpp"
+#ifdef SYNERGY_DYNAMIC_VENDORS
+#include "../dynamic_library.hpp"
+#endif
 
 namespace synergy {
 
@@ -17,6 +21,7 @@ struct nvml {
   static constexpr std::string_view name = "NVML";
   static constexpr unsigned int max_frequencies = 256;
   static constexpr unsigned int sampling_rate = 5; // ms
+  static constexpr bool paired_clocks = true; // core and uncore clocks are set together, in valid pairs
   using device_identifier = unsigned int;
   using device_handle = nvmlDevice_t;
   using return_type = nvmlReturn_t;
@@ -25,6 +30,41 @@ struct nvml {
 
 } // namespace management
 
+// with the versioned names, nvml.h maps the unversioned ones onto them
+#define SYNERGY_NVML_FUNCTIONS(X)              \
+  X(nvmlInit_v2)                               \
+  X(nvmlShutdown)                              \
+  X(nvmlErrorString)                           \
+  X(nvmlDeviceGetCount_v2)                     \
+  X(nvmlDeviceGetHandleByIndex_v2)             \
+  X(nvmlDeviceGetHandleByPciBusId_v2)          \
+  X(nvmlDeviceGetPowerUsage)                   \
+  X(nvmlDeviceGetTotalEnergyConsumption)       \
+  X(nvmlDeviceGetFieldValues)                  \
+  X(nvmlDeviceGetClockInfo)                    \
+  X(nvmlDeviceGetTemperature)                  \
+  X(nvmlDeviceGetUtilizationRates)             \
+  X(nvmlDeviceGetCurrentClocksThrottleReasons) \
+  X(nvmlDeviceGetSupportedGraphicsClocks)      \
+  X(nvmlDeviceGetSupportedMemoryClocks)        \
+  X(nvmlDeviceGetApplicationsClock)            \
+  X(nvmlDeviceSetApplicationsClocks)           \
+  X(nvmlDeviceResetApplicationsClocks)         \
+  X(nvmlDeviceGetArchitecture)                 \
+  X(nvmlDeviceGetPersistenceMode)              \
+  X(nvmlDeviceSetPersistenceMode)              \
+  X(nvmlDeviceGetAutoBoostedClocksEnabled)     \
+  X(nvmlDeviceSetAutoBoostedClocksEnabled)
+
+#ifdef SYNERGY_DYNAMIC_VENDORS
+SYNERGY_NVML_FUNCTIONS(SYNERGY_DECLARE_VENDOR_FUNCTION)
+
+inline void load_nvml() {
+  static dynamic_library nvml_library{management::nvml::name, {"libnvidia-ml.so.1", "libnvidia-ml.so"}};
+  nvml_library.load([](const dynamic_library& library) { SYNERGY_NVML_FUNCTIONS(SYNERGY_RESOLVE_VENDOR_FUNCTION) });
+}
+#endif
+
 template <>
 class management_wrapper<management::nvml> {
 
@@ -36,7 +76,12 @@ public:
     return count;
   }
 
-  inline void initialize() const { check(nvmlInit()); }
+  inline void initialize() const {
+#ifdef SYNERGY_DYNAMIC_VENDORS
+    load_nvml();
+#endif
+    check(nvmlInit());
+  }
 
   inline void shutdown() const { check(nvmlShutdown()); }
 
@@ -48,24 +93,76 @@ public:
     return handle;
   }
 
+  inline nvml::device_handle get_device_handle(const pci_address& address) const {
+    nvml::device_handle handle;
+    check(nvmlDeviceGetHandleByPciBusId_v2(address.to_string().c_str(), &handle));
+    return handle;
+  }
+
   inline power get_power_usage(nvml::device_handle handle) const {
     unsigned int power;
     check(nvmlDeviceGetPowerUsage(handle, &power)); // milliwatts
     return power * 1000;                            // return microwatts
   }
 
+  // available since Volta, NVML_ERROR_NOT_SUPPORTED on older GPUs
   inline energy get_energy_usage(nvml::device_handle handle) const {
-    throw std::runtime_error{"synergy " + std::string(nvml::name) + " wrapper error: get_energy_usage is not supported"};
+    unsigned long long energy;
+    check(nvmlDeviceGetTotalEnergyConsumption(handle, &energy)); // millijoules
+    return energy * 1000.0;                                      // return microjoules
+  }
+
+  // power and energy come in a single nvmlDeviceGetFieldValues round trip; metrics that fail are left empty
+  inline device_sample sample(nvml::device_handle handle) const {
+    device_sample s;
+    s.time = std::chrono::steady_clock::now();
+
+    std::array<nvmlFieldValue_t, 2> fields{};
+    unsigned int count = 0;
+    fields[count++].fieldId = NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION; // millijoules
+#ifdef NVML_FI_DEV_POWER_INSTANT
+    fields[count++].fieldId = NVML_FI_DEV_POWER_INSTANT; // milliwatts
+#endif
+    if (nvmlDeviceGetFieldValues(handle, count, fields.data()) == NVML_SUCCESS) {
+      if (fields[0].nvmlReturn == NVML_SUCCESS)
+        s.energy_usage = field_value(fields[0]) * 1000.0;
+      if (count > 1 && fields[1].nvmlReturn == NVML_SUCCESS)
+        s.power_usage = static_cast<power>(field_value(fields[1]) * 1000);
+    }
+
+    unsigned int value;
+    if (!s.power_usage && nvmlDeviceGetPowerUsage(handle, &value) == NVML_SUCCESS)
+      s.power_usage = value * 1000ULL;
+    if (nvmlDeviceGetClockInfo(handle, NVML_CLOCK_GRAPHICS, &value) == NVML_SUCCESS)
+      s.core_frequency = value;
+    if (nvmlDeviceGetClockInfo(handle, NVML_CLOCK_MEM, &value) == NVML_SUCCESS)
+      s.uncore_frequency = value;
+    if (nvmlDeviceGetTemperature(handle, NVML_TEMPERATURE_GPU, &value) == NVML_SUCCESS)
+      s.temperature = value;
+
+    nvmlUtilization_t utilization;
+    if (nvmlDeviceGetUtilizationRates(handle, &utilization) == NVML_SUCCESS)
+      s.utilization = utilization.gpu;
+
+    unsigned long long reasons;
+    if (nvmlDeviceGetCurrentClocksThrottleReasons(handle, &reasons) == NVML_SUCCESS)
+      s.throttle_reasons = throttle_mask(reasons);
+
+    return s;
   }
 
   inline std::vector<frequency> get_supported_core_frequencies(nvml::device_handle handle) const {
+    return get_supported_core_frequencies(handle, get_uncore_frequency(handle));
+  }
+
+  // the core frequencies that can be paired with the given uncore frequency
+  inline std::vector<frequency> get_supported_core_frequencies(nvml::device_handle handle, frequency uncore_frequency) const {
     using namespace std;
 
-    unsigned int current_uncore_frequency = get_uncore_frequency(handle);
     array<unsigned int, nvml::max_frequencies> core_frequencies;
-    unsigned int count_core_frequencies;
+    unsigned int count_core_frequencies = nvml::max_frequencies;
 
-    check(nvmlDeviceGetSupportedGraphicsClocks(handle, current_uncore_frequency, &count_core_frequencies, core_frequencies.data()));
+    check(nvmlDeviceGetSupportedGraphicsClocks(handle, uncore_frequency, &count_core_frequencies, core_frequencies.data()));
 
     vector<frequency> frequencies(count_core_frequencies);
     for (int i = count_core_frequencies - 1, j = 0; i >= 0; i--, j++) // enforce non-decrescent order
@@ -78,7 +175,7 @@ public:
     using namespace std;
 
     array<unsigned int, nvml::max_frequencies> memory_frequencies;
-    unsigned int count_uncore_frequencies;
+    unsigned int count_uncore_frequencies = nvml::max_frequencies;
 
     check(nvmlDeviceGetSupportedMemoryClocks(handle, &count_uncore_frequencies, memory_frequencies.data()));
 
@@ -108,7 +205,7 @@ public:
 
   inline void set_uncore_frequency(nvml::device_handle handle, frequency target) const {
     std::array<unsigned int, nvml::max_frequencies> core_frequencies;
-    unsigned int count_core_frequencies;
+    unsigned int count_core_frequencies = nvml::max_frequencies;
     check(nvmlDeviceGetSupportedGraphicsClocks(handle, target, &count_core_frequencies, core_frequencies.data()));
 
     check(nvmlDeviceSetApplicationsClocks(handle, target, core_frequencies[0])); // put highest core frequency
@@ -118,6 +215,11 @@ public:
     check(nvmlDeviceSetApplicationsClocks(handle, uncore, core));
   }
 
+  // the frequencies are set as application clocks only
+  inline void reset_frequencies(nvml::device_handle handle) const {
+    check(nvmlDeviceResetApplicationsClocks(handle));
+  }
+
   inline void setup_profiling(nvml::device_handle) const {}
 
   inline void setup_scaling(nvml::device_handle handle) const {
@@ -145,6 +247,38 @@ public:
 
 private:
   error_checker<management::nvml> check{*this};
+
+  static double field_value(const nvmlFieldValue_t& field) {
+    switch (field.valueType) {
+    case NVML_VALUE_TYPE_DOUBLE:
+      return field.value.dVal;
+    case NVML_VALUE_TYPE_UNSIGNED_INT:
+      return field.value.uiVal;
+    case NVML_VALUE_TYPE_UNSIGNED_LONG:
+      return field.value.ulVal;
+    case NVML_VALUE_TYPE_SIGNED_LONG_LONG:
+      return field.value.sllVal;
+    default:
+      return field.value.ullVal;
+    }
+  }
+
+  static unsigned throttle_mask(unsigned long long reasons) {
+    unsigned mask = 0;
+    if (reasons & nvmlClocksThrottleReasonGpuIdle)
+      mask |= device_sample::idle;
+    if (reasons & nvmlClocksThrottleReasonApplicationsClocksSetting)
+      mask |= device_sample::clock_setting;
+    if (reasons & nvmlClocksThrottleReasonSwPowerCap)
+      mask |= device_sample::power_cap;
+    if (reasons & (nvmlClocksThrottleReasonSwThermalSlowdown | nvmlClocksThrottleReasonHwThermalSlowdown))
+      mask |= device_sample::thermal;
+    if (reasons & (nvmlClocksThrottleReasonHwSlowdown | nvmlClocksThrottleReasonHwPowerBrakeSlowdown))
+      mask |= device_sample::hardware;
+    if (reasons & (nvmlClocksThrottleReasonSyncBoost | nvmlClocksThrottleReasonDisplayClockSetting))
+      mask |= device_sample::other;
+    return mask;
+  }
 };
 
 } // namespace detail
@@ -1,12 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include <rocm_smi/rocm_smi.h>
 
 #include "../management_wrapper.hpp"
+#ifdef SYNERGY_DYNAMIC_VENDORS
+#include "../dynamic_library.hpp"
+#endif
 
 namespace synergy {
 
@@ -17,6 +26,7 @@ struct rsmi {
   static constexpr std::string_view name = "RSMI";
   static constexpr unsigned int max_frequencies = RSMI_MAX_NUM_FREQUENCIES;
   static constexpr unsigned int sampling_rate = 5; // ms
+  static constexpr bool paired_clocks = false;
   using device_identifier = unsigned int;
   using device_handle = unsigned int;
   using return_type = rsmi_status_t;
@@ -25,6 +35,27 @@ struct rsmi {
 
 } // namespace management
 
+#define SYNERGY_RSMI_FUNCTIONS(X)  \
+  X(rsmi_init)                     \
+  X(rsmi_status_string)            \
+  X(rsmi_num_monitor_devices)      \
+  X(rsmi_dev_pci_id_get)           \
+  X(rsmi_dev_power_ave_get)        \
+  X(rsmi_dev_gpu_metrics_info_get) \
+  X(rsmi_dev_temp_metric_get)      \
+  X(rsmi_dev_gpu_clk_freq_get)     \
+  X(rsmi_dev_gpu_clk_freq_set)     \
+  X(rsmi_dev_perf_level_set)
+
+#ifdef SYNERGY_DYNAMIC_VENDORS
+SYNERGY_RSMI_FUNCTIONS(SYNERGY_DECLARE_VENDOR_FUNCTION)
+
+inline void load_rsmi() {
+  static dynamic_library rsmi_library{management::rsmi::name, {"librocm_smi64.so", "librocm_smi64.so.7", "librocm_smi64.so.6", "librocm_smi64.so.5", "/opt/rocm/lib/librocm_smi64.so"}};
+  rsmi_library.load([](const dynamic_library& library) { SYNERGY_RSMI_FUNCTIONS(SYNERGY_RESOLVE_VENDOR_FUNCTION) });
+}
+#endif
+
 template <>
 class management_wrapper<management::rsmi> {
 
@@ -35,7 +66,12 @@ public:
     return count;
   }
 
-  inline void initialize() const { check(rsmi_init(0)); }
+  inline void initialize() const {
+#ifdef SYNERGY_DYNAMIC_VENDORS
+    load_rsmi();
+#endif
+    check(rsmi_init(0));
+  }
 
   inline void shutdown() const {
     /*check(rsmi_shut_down());*/
@@ -45,6 +81,18 @@ public:
 
   inline rsmi::device_handle get_device_handle(rsmi::device_identifier id) const { return id; }
 
+  inline rsmi::device_handle get_device_handle(const pci_address& address) const {
+    for (unsigned int i = 0; i < get_devices_count(); i++) {
+      uint64_t bdfid;
+      check(rsmi_dev_pci_id_get(i, &bdfid)); // domain[63:32] bus[15:8] device[7:3] function[2:0]
+      pci_address candidate{static_cast<unsigned>(bdfid >> 32), static_cast<unsigned>((bdfid >> 8) & 0xff),
+                            static_cast<unsigned>((bdfid >> 3) & 0x1f), static_cast<unsigned>(bdfid & 0x7)};
+      if (candidate == address)
+        return i;
+    }
+    throw std::runtime_error{"synergy " + std::string(rsmi::name) + " wrapper error: no device at PCI address " + address.to_string()};
+  }
+
   inline power get_power_usage(rsmi::device_handle handle) const {
     uint64_t power;
     check(rsmi_dev_power_ave_get(handle, 0, &power)); // microwatts
@@ -55,6 +103,31 @@ public:
     throw std::runtime_error{"synergy " + std::string(rsmi::name) + " wrapper error: get_energy_usage is not supported"};
   }
 
+  // most metrics come from the GPU metrics table in a single call; metrics that fail are left empty
+  inline device_sample sample(rsmi::device_handle handle) const {
+    device_sample s;
+    s.time = std::chrono::steady_clock::now();
+
+    rsmi_gpu_metrics_t metrics;
+    if (rsmi_dev_gpu_metrics_info_get(handle, &metrics) == RSMI_STATUS_SUCCESS) {
+      s.power_usage = metrics.average_socket_power * 1000000ULL;       // watts to microwatts
+      s.energy_usage = metrics.energy_accumulator * energy_resolution; // microjoules
+      s.core_frequency = metrics.current_gfxclk;
+      s.uncore_frequency = metrics.current_uclk;
+      s.utilization = metrics.average_gfx_activity;
+    } else {
+      uint64_t power;
+      if (rsmi_dev_power_ave_get(handle, 0, &power) == RSMI_STATUS_SUCCESS)
+        s.power_usage = power;
+    }
+
+    int64_t temperature;
+    if (rsmi_dev_temp_metric_get(handle, RSMI_TEMP_TYPE_EDGE, RSMI_TEMP_CURRENT, &temperature) == RSMI_STATUS_SUCCESS)
+      s.temperature = temperature / 1000.0; // millidegrees
+
+    return s;
+  }
+
   inline std::vector<frequency> get_supported_core_frequencies(rsmi::device_handle handle) const {
     rsmi_frequencies_t core;
     check(rsmi_dev_gpu_clk_freq_get(handle, RSMI_CLK_TYPE_SYS, &core));
@@ -89,39 +162,18 @@ public:
   }
 
   inline void set_core_frequency(rsmi::device_handle handle, frequency target) const {
-    rsmi_frequencies_t core;
-    check(rsmi_dev_gpu_clk_freq_get(handle, RSMI_CLK_TYPE_SYS, &core));
-    // the AMD freqs are in Hz while target are in MHz
-    target *= 1e6;
-
-    int target_index = -1;
-    for (size_t i = 0; i < core.num_supported && target_index == -1; i++) {
-      if (core.frequency[i] == target)
-        target_index = i;
-    }
-
-    if (target_index == -1)
-      return; // silent fail, must handle better
-
-    check(rsmi_dev_gpu_clk_freq_set(handle, RSMI_CLK_TYPE_SYS, make_bitmask(target_index)));
+    const auto& core = frequency_indices(handle, RSMI_CLK_TYPE_SYS);
+    check(rsmi_dev_gpu_clk_freq_set(handle, RSMI_CLK_TYPE_SYS, make_bitmask(index_of(core, target))));
   }
 
   inline void set_uncore_frequency(rsmi::device_handle handle, frequency target) const {
-    rsmi_frequencies_t uncore;
-    check(rsmi_dev_gpu_clk_freq_get(handle, RSMI_CLK_TYPE_MEM, &uncore));
-    target *= 1e6;
-    int target_index = -1;
-    for (size_t i = 0; i < uncore.num_supported && target_index == -1; i++)
-      if (uncore.frequency[i] == target)
-        target_index = i;
+    const auto& uncore = frequency_indices(handle, RSMI_CLK_TYPE_MEM);
+    auto index = index_of(uncore, target);
 
-    if (target_index == -1)
-      return; // silent fail, must handle better check(RSMI_STATUS_NOT_SUPPORTED)
-
-    if (uncore.num_supported == 1) // with only one freqeuncy available there is no need to change the frequency
+    if (uncore.size() == 1) // with only one freqeuncy available there is no need to change the frequency
       return;
 
-    check(rsmi_dev_gpu_clk_freq_set(handle, RSMI_CLK_TYPE_MEM, make_bitmask(target_index)));
+    check(rsmi_dev_gpu_clk_freq_set(handle, RSMI_CLK_TYPE_MEM, make_bitmask(index)));
   }
 
   inline void set_all_frequencies(rsmi::device_handle handle, frequency core, frequency uncore) const {
@@ -129,6 +181,11 @@ public:
     set_core_frequency(handle, core);
   }
 
+  // setting a frequency moves the device to the manual performance level, auto restores the default clocks
+  inline void reset_frequencies(rsmi::device_handle handle) const {
+    check(rsmi_dev_perf_level_set(handle, RSMI_DEV_PERF_LEVEL_AUTO));
+  }
+
   inline void setup_profiling(rsmi::device_handle) const {}
 
   inline void setup_scaling(rsmi::device_handle) const {}
@@ -140,6 +197,39 @@ public:
   }
 
 private:
+  // frequency in MHz and its index in the table of the device, sorted by frequency
+  using frequency_index = std::pair<frequency, uint32_t>;
+
+  mutable std::mutex tables_mutex;
+  mutable std::map<std::pair<rsmi::device_handle, rsmi_clk_type_t>, std::vector<frequency_index>> tables;
+
+  // the frequency table of a clock is read on the first frequency change, setters look targets up in it
+  const std::vector<frequency_index>& frequency_indices(rsmi::device_handle handle, rsmi_clk_type_t type) const {
+    std::lock_guard<std::mutex> lock{tables_mutex};
+    auto search = tables.find({handle, type});
+    if (search != tables.end())
+      return search->second;
+
+    rsmi_frequencies_t available;
+    check(rsmi_dev_gpu_clk_freq_get(handle, type, &available));
+
+    std::vector<frequency_index> table;
+    for (uint32_t i = 0; i < available.num_supported; i++)
+      table.emplace_back(available.frequency[i] / 1e6, i); // the AMD freqs are in Hz while target are in MHz
+    std::sort(table.begin(), table.end());
+
+    return tables.emplace(std::make_pair(handle, type), std::move(table)).first->second;
+  }
+
+  uint32_t index_of(const std::vector<frequency_index>& table, frequency target) const {
+    auto search = std::lower_bound(table.begin(), table.end(), frequency_index{target, 0});
+    if (search == table.end() || search->first != target)
+      throw std::runtime_error{"synergy " + std::string(rsmi::name) + " wrapper error: unsupported frequency " + std::to_string(target)};
+    return search->second;
+  }
+
+  static constexpr double energy_resolution = 15.259; // microjoules per unit of the energy accumulator
+
   unsigned long make_bitmask(uint32_t desired_frequency_index) const {
     return 1UL << desired_frequency_index;
   }
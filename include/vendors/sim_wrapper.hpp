@@ -0,0 +1,306 @@
+#pragma once
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../management_wrapper.hpp"
+
+namespace synergy {
+
+/**
+ * Parameters of a simulated device. Power is static_power plus, scaled by the load, a core part
+ * growing with the cube of the core frequency and an uncore part growing linearly with the uncore
+ * frequency, both reaching their maximum at the highest frequency of the table. Sensors latch power
+ * and energy every sensor_update_period, and a new frequency takes effect set_frequency_latency
+ * after it is requested.
+ */
+struct sim_config {
+  std::vector<frequency> core_frequencies{300, 400, 500, 600, 700, 800, 900, 1000, 1100, 1200, 1300, 1400, 1500}; // MHz
+  std::vector<frequency> uncore_frequencies{800, 1200, 1600};                                                     // MHz
+  frequency default_core_frequency = 1500;
+  frequency default_uncore_frequency = 1600;
+
+  double static_power = 40.0;         // W
+  double core_dynamic_power = 180.0;  // W at the highest core frequency and full load
+  double uncore_dynamic_power = 30.0; // W at the highest uncore frequency and full load
+
+  double load = -1.0; // fixed load in [0, 1]; negative follows the CPU usage of the process
+
+  std::chrono::milliseconds sensor_update_period{10};
+  std::chrono::milliseconds set_frequency_latency{5};
+};
+
+namespace detail {
+
+namespace management {
+struct sim {
+  static constexpr std::string_view name = "SIM";
+  static constexpr unsigned int sampling_rate = 5; // ms
+  static constexpr bool paired_clocks = false;
+  using device_identifier = unsigned int;
+  using device_handle = unsigned int;
+  using return_type = int;
+  static constexpr int return_success = 0;
+};
+
+} // namespace management
+
+/**
+ * State of one simulated device, advanced lazily to the current time whenever it is queried. The
+ * energy is integrated exactly, since power only changes when the frequency or the load does.
+ */
+class sim_device_state {
+public:
+  using clock = std::chrono::steady_clock;
+
+  sim_device_state(const sim_config& config)
+      : config{config}, core{config.default_core_frequency}, uncore{config.default_uncore_frequency} {
+    std::sort(this->config.core_frequencies.begin(), this->config.core_frequencies.end());
+    std::sort(this->config.uncore_frequencies.begin(), this->config.uncore_frequencies.end());
+    if (this->config.core_frequencies.empty() || this->config.uncore_frequencies.empty())
+      throw std::runtime_error{"synergy " + std::string(management::sim::name) + " wrapper error: empty frequency table"};
+
+    time = clock::now();
+    latched_time = time;
+    cpu_time = process_cpu_time();
+    load = config.load < 0 ? 0.0 : std::min(config.load, 1.0);
+    latched_power = current_power();
+  }
+
+  const sim_config& get_config() const { return config; }
+
+  // the values latched by the sensors at their latest update
+  std::pair<power, energy> read_sensors() {
+    std::lock_guard<std::mutex> lock{mutex};
+    advance(clock::now());
+    return {static_cast<power>(latched_power * 1000000.0), latched_energy * 1000000.0}; // microwatts, microjoules
+  }
+
+  device_sample sample() {
+    std::lock_guard<std::mutex> lock{mutex};
+    device_sample s;
+    s.time = clock::now();
+    advance(s.time);
+    s.power_usage = static_cast<power>(latched_power * 1000000.0);
+    s.energy_usage = latched_energy * 1000000.0;
+    s.core_frequency = core;
+    s.uncore_frequency = uncore;
+    s.utilization = static_cast<unsigned>(load * 100);
+    s.throttle_reasons = load == 0 ? static_cast<unsigned>(device_sample::idle) : 0u;
+    return s;
+  }
+
+  std::pair<frequency, frequency> get_frequencies() {
+    std::lock_guard<std::mutex> lock{mutex};
+    advance(clock::now());
+    return {core, uncore};
+  }
+
+  void request_frequencies(frequency core_target, frequency uncore_target) {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (core_target && !supported(config.core_frequencies, core_target))
+      throw std::runtime_error{"synergy " + std::string(management::sim::name) + " wrapper error: unsupported core frequency " + std::to_string(core_target)};
+    if (uncore_target && !supported(config.uncore_frequencies, uncore_target))
+      throw std::runtime_error{"synergy " + std::string(management::sim::name) + " wrapper error: unsupported uncore frequency " + std::to_string(uncore_target)};
+
+    auto now = clock::now();
+    advance(now);
+    pending = pending_change{core_target ? core_target : (pending ? pending->core : core),
+                             uncore_target ? uncore_target : (pending ? pending->uncore : uncore),
+                             now + config.set_frequency_latency};
+  }
+
+  void set_load(double new_load) {
+    std::lock_guard<std::mutex> lock{mutex};
+    advance(clock::now());
+    config.load = new_load;
+    if (new_load >= 0)
+      load = std::min(new_load, 1.0);
+  }
+
+private:
+  struct pending_change {
+    frequency core;
+    frequency uncore;
+    clock::time_point effective;
+  };
+
+  sim_config config;
+  std::mutex mutex;
+
+  clock::time_point time; // the state below is exact at this time
+  double energy_consumed = 0.0; // J
+  frequency core;
+  frequency uncore;
+  double load;
+  double cpu_time; // s, to measure the load of the process
+  std::optional<pending_change> pending;
+
+  clock::time_point latched_time;
+  double latched_power = 0.0;  // W
+  double latched_energy = 0.0; // J
+
+  static bool supported(const std::vector<frequency>& table, frequency f) {
+    return std::binary_search(table.begin(), table.end(), f);
+  }
+
+  static double process_cpu_time() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  double current_power() const {
+    double core_ratio = static_cast<double>(core) / config.core_frequencies.back();
+    double uncore_ratio = static_cast<double>(uncore) / config.uncore_frequencies.back();
+    return config.static_power + load * (config.core_dynamic_power * std::pow(core_ratio, 3) + config.uncore_dynamic_power * uncore_ratio);
+  }
+
+  // integrates up to t with constant power, latching the sensors at the last update period crossed
+  void integrate(clock::time_point t) {
+    double watts = current_power();
+    auto period = config.sensor_update_period.count() > 0 ? clock::duration{config.sensor_update_period} : clock::duration{1};
+    auto crossed = (t - latched_time) / period;
+    if (crossed > 0) {
+      latched_time += crossed * period;
+      latched_energy = energy_consumed + watts * std::chrono::duration<double>(latched_time - time).count();
+      latched_power = watts;
+    }
+    energy_consumed += watts * std::chrono::duration<double>(t - time).count();
+    time = t;
+  }
+
+  void advance(clock::time_point now) {
+    if (now <= time)
+      return;
+
+    if (config.load < 0) { // the load of the whole interval is the CPU usage of the process over it
+      double cpu_now = process_cpu_time();
+      double wall = std::chrono::duration<double>(now - time).count() * std::max(1u, std::thread::hardware_concurrency());
+      load = std::clamp((cpu_now - cpu_time) / wall, 0.0, 1.0);
+      cpu_time = cpu_now;
+    }
+
+    if (pending && pending->effective <= now) {
+      integrate(std::max(pending->effective, time));
+      core = pending->core;
+      uncore = pending->uncore;
+      pending.reset();
+    }
+    integrate(now);
+  }
+};
+
+/**
+ * Simulated devices, configured with synergy::configure_simulation before their first use, so that
+ * queues, profilers and frequency scaling can run without vendor libraries or GPUs.
+ */
+template <>
+class management_wrapper<management::sim> {
+
+public:
+  inline unsigned int get_devices_count() const { return 1; }
+
+  inline void initialize() const {}
+
+  inline void shutdown() const {}
+
+  using sim = management::sim;
+
+  inline sim::device_handle get_device_handle(sim::device_identifier id) const {
+    state(id);
+    return id;
+  }
+
+  inline sim::device_handle get_device_handle(const pci_address&) const {
+    throw std::runtime_error{"synergy " + std::string(sim::name) + " wrapper error: devices cannot be looked up by PCI address"};
+  }
+
+  inline power get_power_usage(sim::device_handle handle) const { return state(handle).read_sensors().first; }
+
+  inline energy get_energy_usage(sim::device_handle handle) const { return state(handle).read_sensors().second; }
+
+  inline device_sample sample(sim::device_handle handle) const { return state(handle).sample(); }
+
+  inline std::vector<frequency> get_supported_core_frequencies(sim::device_handle handle) const { return state(handle).get_config().core_frequencies; }
+
+  inline std::vector<frequency> get_supported_uncore_frequencies(sim::device_handle handle) const { return state(handle).get_config().uncore_frequencies; }
+
+  inline frequency get_core_frequency(sim::device_handle handle) const { return state(handle).get_frequencies().first; }
+
+  inline frequency get_uncore_frequency(sim::device_handle handle) const { return state(handle).get_frequencies().second; }
+
+  inline void set_core_frequency(sim::device_handle handle, frequency target) const { state(handle).request_frequencies(target, 0); }
+
+  inline void set_uncore_frequency(sim::device_handle handle, frequency target) const { state(handle).request_frequencies(0, target); }
+
+  inline void set_all_frequencies(sim::device_handle handle, frequency core, frequency uncore) const { state(handle).request_frequencies(core, uncore); }
+
+  inline void reset_frequencies(sim::device_handle handle) const {
+    const sim_config& config = state(handle).get_config();
+    state(handle).request_frequencies(config.default_core_frequency, config.default_uncore_frequency);
+  }
+
+  inline void setup_profiling(sim::device_handle) const {}
+
+  inline void setup_scaling(sim::device_handle) const {}
+
+  inline std::string error_string(sim::return_type return_value) const { return std::strerror(return_value); }
+
+  // the configuration given to the devices created from now on
+  static void configure(const sim_config& config) {
+    std::lock_guard<std::mutex> lock{registry().mutex};
+    registry().config = config;
+  }
+
+  static void set_load(sim::device_handle handle, double load) { state(handle).set_load(load); }
+
+private:
+  // simulated devices outlive the wrappers, like real hardware
+  struct device_registry {
+    std::mutex mutex;
+    sim_config config;
+    std::map<sim::device_handle, std::unique_ptr<sim_device_state>> devices;
+  };
+
+  static device_registry& registry() {
+    static device_registry r;
+    return r;
+  }
+
+  static sim_device_state& state(sim::device_handle handle) {
+    device_registry& r = registry();
+    std::lock_guard<std::mutex> lock{r.mutex};
+    auto& device = r.devices[handle];
+    if (!device)
+      device = std::make_unique<sim_device_state>(r.config);
+    return *device;
+  }
+};
+
+} // namespace detail
+
+// applies to the simulated devices that have not been used yet
+inline void configure_simulation(const sim_config& config) {
+  detail::management_wrapper<detail::management::sim>::configure(config);
+}
+
+// fixes the load of a simulated device, a negative load follows the CPU usage of the process again
+inline void set_simulated_load(double load, unsigned int device = 0) {
+  detail::management_wrapper<detail::management::sim>::set_load(device, load);
+}
+
+} // namespace synergy
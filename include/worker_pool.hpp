@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "topology.hpp"
+
+namespace synergy {
+
+namespace detail {
+
+/**
+ * Fixed set of threads consuming tasks in submission order. Pending tasks are drained before the
+ * pool is destroyed.
+ */
+class worker_pool {
+public:
+  worker_pool(unsigned workers = 1) {
+    for (unsigned i = 0; i < workers; i++)
+      threads.emplace_back([this] { run(); });
+  }
+
+  worker_pool(const worker_pool&) = delete;
+  worker_pool& operator=(const worker_pool&) = delete;
+
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      stopping = true;
+    }
+    available.notify_all();
+
+    for (auto& t : threads)
+      t.join();
+  }
+
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit(F task) {
+    using result_type = std::invoke_result_t<F>;
+
+    // std::function requires copyable targets, hence the shared_ptr around the packaged_task
+    auto packaged = std::make_shared<std::packaged_task<result_type()>>(std::move(task));
+    auto future = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      tasks.emplace_back([packaged] { (*packaged)(); });
+    }
+    available.notify_one();
+
+    return future;
+  }
+
+  // restricts the workers to the given CPUs, e.g. the ones local to the device they wait for
+  void pin(const std::vector<unsigned>& cpus) {
+    for (auto& t : threads)
+      pin_thread(t.native_handle(), cpus);
+  }
+
+  // waits until every submitted task has completed
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock{mutex};
+    idle.wait(lock, [this] { return tasks.empty() && running == 0; });
+  }
+
+private:
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable available;
+  std::condition_variable idle;
+  unsigned running = 0;
+  bool stopping = false;
+
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock{mutex};
+        available.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+        if (tasks.empty())
+          return;
+
+        task = std::move(tasks.front());
+        tasks.pop_front();
+        running++;
+      }
+      task();
+
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        running--;
+      }
+      idle.notify_all();
+    }
+  }
+};
+
+} // namespace detail
+
+} // namespace synergy
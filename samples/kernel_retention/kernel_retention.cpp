@@ -0,0 +1,53 @@
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <synergy.hpp>
+
+// checks that the record of a kernel older than max_age is evicted even if no other kernel is submitted
+constexpr std::chrono::milliseconds MAX_AGE{500};
+constexpr int N = 1024;
+
+bool is_recorded(synergy::queue& q, const sycl::event& event) {
+  try {
+    q.kernel_energy_consumption(event);
+    return true;
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+}
+
+int main() {
+  synergy::queue q{sycl::cpu_selector_v};
+  q.set_kernel_retention(synergy::kernel_retention{0, MAX_AGE});
+  bool ok = true;
+
+  std::vector<int> a(N, 1);
+  sycl::event event;
+  {
+    sycl::buffer<int, 1> buf{a.data(), N};
+    event = q.submit([&](sycl::handler& h) {
+      sycl::accessor acc{buf, h, sycl::read_write};
+      h.parallel_for(sycl::range<1>{N}, [=](sycl::id<1> id) { acc[id] *= 2; });
+    });
+    event.wait();
+  }
+
+  if (!is_recorded(q, event)) {
+    std::cout << "Kernel record missing before max_age [FAILED]\n";
+    ok = false;
+  }
+
+  std::this_thread::sleep_for(2 * MAX_AGE);
+
+  if (is_recorded(q, event)) {
+    std::cout << "Kernel record still returned after max_age [FAILED]\n";
+    ok = false;
+  }
+  if (q.release_kernel(event)) {
+    std::cout << "Kernel record still released after max_age [FAILED]\n";
+    ok = false;
+  }
+
+  return ok ? 0 : 1;
+}
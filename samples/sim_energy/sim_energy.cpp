@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <synergy.hpp>
+
+// runs against the simulated device of SYNERGY_SIM_SUPPORT and checks the energy reported by SYnergy against its power model
+constexpr synergy::frequency CORE_FREQ = 1000;
+constexpr synergy::frequency UNCORE_FREQ = 1200;
+constexpr double TOLERANCE = 0.05;
+constexpr int N = 1024;
+
+bool check(const char* what, double measured, double expected) {
+  bool ok = std::abs(measured - expected) <= TOLERANCE * expected;
+  std::cout << what << ": " << measured << " j, expected " << expected << " j" << (ok ? "" : " [FAILED]") << "\n";
+  return ok;
+}
+
+int main() {
+  synergy::sim_config config;
+  config.load = 1.0; // the CPU usage of the process would make the expected power unpredictable
+  synergy::configure_simulation(config);
+
+  double core_ratio = static_cast<double>(CORE_FREQ) / config.core_frequencies.back();
+  double uncore_ratio = static_cast<double>(UNCORE_FREQ) / config.uncore_frequencies.back();
+  double watts = config.static_power + config.load * (config.core_dynamic_power * std::pow(core_ratio, 3) + config.uncore_dynamic_power * uncore_ratio);
+
+  synergy::queue q{UNCORE_FREQ, CORE_FREQ, sycl::cpu_selector_v};
+  auto device = q.get_synergy_device();
+  bool ok = true;
+
+  // the queue frequencies are applied with the first kernel
+  std::vector<int> a(N, 1);
+  {
+    sycl::buffer<int, 1> buf{a.data(), N};
+    q.submit([&](sycl::handler& h) {
+      sycl::accessor acc{buf, h, sycl::read_write};
+      h.parallel_for(sycl::range<1>{N}, [=](sycl::id<1> id) { acc[id] *= 2; });
+    }).wait();
+  }
+  std::this_thread::sleep_for(config.set_frequency_latency + 2 * config.sensor_update_period);
+
+  if (device.get_core_frequency(false) != CORE_FREQ || device.get_uncore_frequency(false) != UNCORE_FREQ) {
+    std::cout << "frequencies: " << device.get_uncore_frequency(false) << " " << device.get_core_frequency(false)
+              << " MHz, expected " << UNCORE_FREQ << " " << CORE_FREQ << " MHz [FAILED]\n";
+    ok = false;
+  }
+
+#ifdef SYNERGY_DEVICE_PROFILING
+  double profiled_start = q.device_energy_consumption();
+#endif
+  auto start = std::chrono::steady_clock::now();
+  auto energy_start = device.get_energy_usage();
+
+  synergy::region_begin("window");
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  synergy::region_end("window");
+
+  auto energy_end = device.get_energy_usage();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  ok &= check("Device energy counter", (energy_end - energy_start) / 1000000.0, watts * seconds);
+#ifdef SYNERGY_DEVICE_PROFILING
+  ok &= check("Device energy consumption", q.device_energy_consumption() - profiled_start, watts * seconds);
+#endif
+#ifdef SYNERGY_ENABLE_PROFILING
+  auto regions = synergy::region_snapshot();
+  if (regions.size() != 1) {
+    std::cout << "Regions: " << regions.size() << ", expected 1 [FAILED]\n";
+    ok = false;
+  } else {
+    ok &= check("Region device energy", regions[0].device_energy, watts * regions[0].wall_time);
+  }
+#endif
+
+  return ok ? 0 : 1;
+}